@@ -19,6 +19,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,9 +45,10 @@ static inline void clearBoard(Board *board) {
 
     // Wipe the entire board structure, and also set all of
     // the pieces on the board to be EMPTY. Ideally, before
-    // this board is used again we will call boardFromFEN()
+    // this board is used again we will call boardFromFEN().
+    // The history is only read below numMoves, so it is left
 
-    memset(board, 0, sizeof(Board));
+    memset(board, 0, offsetof(Board, history));
     memset(&board->squares, EMPTY, sizeof(board->squares));
 }
 
@@ -280,6 +282,18 @@ void printBoard(Board *board) {
     printf("\n%s\n\n", fen);
 }
 
+void boardCopy(Board *dst, const Board *src) {
+
+    /// Copy a Board for searching. Repetitions cannot span an irreversible move,
+    /// so only the hashes since the last one are copied, leaving the rest of the
+    /// history stale. The cost depends on the fifty move counter, not game length
+
+    const int first = MAX(0, src->numMoves - src->halfMoveCounter);
+
+    memcpy(dst, src, offsetof(Board, history));
+    memcpy(&dst->history[first], &src->history[first], sizeof(uint64_t) * (src->numMoves - first));
+}
+
 int boardDrawnByRepetition(Board *board, int height) {
 
     int reps = 0;
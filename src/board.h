@@ -33,8 +33,8 @@ struct Board {
     uint64_t castleRooks, castleMasks[SQUARE_NB];
     int turn, epSquare, halfMoveCounter, fullMoveCounter;
     int psqtmat, numMoves, chess960;
-    uint64_t history[MAX_HISTORY];
     Thread *thread;
+    uint64_t history[MAX_HISTORY]; // Must come last, see boardCopy()
 };
 
 struct Undo {
@@ -47,6 +47,7 @@ struct Undo {
 void squareToString(int sq, char *str);
 void boardFromFEN(Board *board, const char *fen, int chess960);
 void boardToFEN(Board *board, char *fen);
+void boardCopy(Board *dst, const Board *src);
 void printBoard(Board *board);
 int boardDrawnByRepetition(Board *board, int height);
 int boardDrawnByInsufficientMaterial(Board *board);
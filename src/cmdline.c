@@ -17,14 +17,24 @@
 */
 
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
 #include "bitboards.h"
 #include "board.h"
 #include "cmdline.h"
 #include "move.h"
+#include "movegen.h"
 // #include "pgn.h"
 #include "search.h"
 #include "thread.h"
@@ -32,41 +42,48 @@
 #include "transposition.h"
 #include "tuner.h"
 #include "uci.h"
+#include "windows.h"
 
-//#include "nnue/nnue.h"
+#include "nnue/accumulator.h"
+#include "nnue/nnue.h"
+#include "nnue/types.h"
 
-static void runBenchmark(int argc, char **argv) {
+extern int CalibratedTime; // Defined by timeman.c
+extern int Deterministic;  // Defined by search.c
+
+static const char *Benchmarks[] = {
+    #include "bench.csv"
+    ""
+};
 
-    static const char *Benchmarks[] = {
-        #include "bench.csv"
-        ""
-    };
+static void runBenchmark(int argc, char **argv) {
 
     Board board;
     Thread *threads;
     Limits limits = {0};
 
     int scores[256];
-    double times[256];
+    double times[256], latencies[256];
     uint64_t nodes[256];
     uint16_t bestMoves[256];
     uint16_t ponderMoves[256];
 
-    double time;
+    double time, maxLatency = 0.0, totalLatency = 0.0;
     uint64_t totalNodes = 0ull;
+    TTStats ttstats = {0};
 
     int depth     = argc > 2 ? atoi(argv[2]) : 13;
     int nthreads  = argc > 3 ? atoi(argv[3]) :  1;
     int megabytes = argc > 4 ? atoi(argv[4]) : 16;
 
-    // if (argc > 5) {
-    //     nnue_init(argv[5]);
-    //     printf("info string set EvalFile to %s\n", argv[5]);
-    // }
+    if (argc > 5) {
+        nnue_init(argv[5]);
+        printf("info string set EvalFile to %s\n", argv[5]);
+    }
 
-    tt_init(nthreads, megabytes);
     time = get_real_time();
     threads = createThreadPool(nthreads);
+    tt_init(threads, megabytes);
 
     // Initialize a "go depth <x>" search
 #ifdef ENABLE_MULTI_PV
@@ -85,8 +102,14 @@ static void runBenchmark(int argc, char **argv) {
         // Stat collection for later printing
         times[i] = get_real_time() - limits.start;
         nodes[i] = nodesSearchedThreadPool(threads);
+        ttstatsThreadPool(threads, &ttstats);
+
+        // Delay until the last Thread reached its first node
+        latencies[i] = 0.0;
+        for (int j = 0; j < nthreads; j++)
+            latencies[i] = MAX(latencies[i], threads[j].started - limits.start);
 
-        tt_clear(nthreads); // Reset TT between searches
+        tt_clear(threads); // Reset TT between searches
     }
 
     printf("\n===============================================================================\n");
@@ -110,9 +133,510 @@ static void runBenchmark(int argc, char **argv) {
     for (int i = 0; strcmp(Benchmarks[i], ""); i++) totalNodes += nodes[i];
     printf("OVERALL: %47d nodes %12d nps\n", (int)totalNodes, (int)(1000.0f * totalNodes / (time + 1)));
 
+    // Report the go-to-first-node latency of the Thread Pool
+    int count = 0;
+    for (; strcmp(Benchmarks[count], ""); count++) {
+        totalLatency += latencies[count];
+        maxLatency = MAX(maxLatency, latencies[count]);
+    }
+    printf("LATENCY: %39.3f ms average %9.3f ms max\n", totalLatency / count, maxLatency);
+
+    // Report whether the Threads were bound to NUMA nodes
+    printf("NUMA: %42d nodes %12s\n", numaNodeCount(),
+        nthreads > 8 && numaNodeCount() > 1 ? "bound" : "unbound");
+
+    // Report how often the Transposition Table found an Entry
+#ifdef ENABLE_TT_STATS
+    printf("TTHITS: %40.2f %% of %12"PRIu64" probes\n",
+        100.0 * ttstats.hits / MAX(1ull, ttstats.probes), ttstats.probes);
+
+    printf("===============================================================================\n");
+    tt_print_stats(&ttstats);
+#else
+    printf("TTHITS: %42s of %12s probes\n", "n/a", "n/a");
+#endif
+
     deleteThreadPool(threads);
 }
 
+static void runScalingBenchmark(int argc, char **argv) {
+
+    /// Search the bench positions with 1, 2, 4, ... up to maxthreads Threads, and
+    /// compare each against the single Thread run. The time-to-depth speedup is
+    /// given both in total and as a geometric mean over the positions, alongside
+    /// the nps speedup, and the search overhead in extra nodes searched. Results
+    /// are written as CSV, to stdout after the searches, or to the given file
+
+    Board board;
+    Thread *threads;
+    Limits limits = {0};
+
+    int counts[32], ncounts = 0, npositions = 0;
+    double baseTimes[256], baseNodes = 0.0, baseTime = 0.0;
+    uint16_t best, ponder; int score;
+
+    int depth      = argc > 3 ? atoi(argv[3]) : 13;
+    int maxthreads = argc > 4 ? atoi(argv[4]) :  8;
+    int megabytes  = argc > 5 ? atoi(argv[5]) : 16;
+    FILE *fout     = argc > 6 ? fopen(argv[6], "w") : NULL;
+
+    double times[32], logSpeedups[32];
+    uint64_t nodes[32];
+
+    // Fail before the searches, rather than losing their results
+    if (argc > 6 && fout == NULL)
+        fprintf(stderr, "info string Unable to open %s\n", argv[6]), exit(EXIT_FAILURE);
+
+    // Powers of two, followed by maxthreads itself
+    for (int n = 1; n < maxthreads && ncounts < 31; n *= 2)
+        counts[ncounts++] = n;
+    counts[ncounts++] = MAX(1, maxthreads);
+
+    // Initialize a "go depth <x>" search
+#ifdef ENABLE_MULTI_PV
+    limits.multiPV        = 1;
+#endif
+    limits.limitedByDepth = 1;
+    limits.depthLimit     = depth;
+
+    for (int c = 0; c < ncounts; c++) {
+
+        threads = createThreadPool(counts[c]);
+        tt_init(threads, megabytes);
+
+        times[c] = 0.0, nodes[c] = 0ull, logSpeedups[c] = 0.0;
+
+        for (int i = 0; strcmp(Benchmarks[i], ""); i++, npositions = i) {
+
+            // Every search starts from the same, empty, state
+            resetThreadPool(threads); tt_clear(threads);
+
+            limits.start = get_real_time();
+            boardFromFEN(&board, Benchmarks[i], 0);
+            getBestMove(threads, &board, &limits, &best, &ponder, &score);
+
+            const double elapsed = MAX(0.001, get_real_time() - limits.start);
+
+            // The single Thread run is the baseline for all others
+            if (c == 0) baseTimes[i] = elapsed;
+            logSpeedups[c] += log(baseTimes[i] / elapsed);
+
+            times[c] += elapsed;
+            nodes[c] += nodesSearchedThreadPool(threads);
+        }
+
+        if (c == 0) baseTime = times[0], baseNodes = nodes[0];
+
+        deleteThreadPool(threads);
+    }
+
+    FILE *csv = fout ? fout : stdout;
+
+    fprintf(csv, "threads,depth,time_ms,nodes,nps,speedup,geomean_speedup,nps_speedup,overhead\n");
+
+    for (int c = 0; c < ncounts; c++) {
+        const double nps = 1000.0 * nodes[c] / times[c];
+        fprintf(csv, "%d,%d,%.1f,%"PRIu64",%.0f,%.3f,%.3f,%.3f,%.3f\n",
+            counts[c], depth, times[c], nodes[c], nps,
+            baseTime / times[c], exp(logSpeedups[c] / npositions),
+            nps / (1000.0 * baseNodes / baseTime), nodes[c] / baseNodes - 1.0);
+    }
+
+    if (fout) fclose(fout);
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    const double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void runLatencyBenchmark(int argc, char **argv) {
+
+    /// Replay the bench positions as "gp movetime <x> fen <FEN>" requests, through
+    /// the same path as the UCI loop. Each request is timed from before the command
+    /// is parsed until the bestmove has been reported, and the overshoot past the
+    /// deadline given to the search is summarised as p50, p90, p99 and the max
+
+    Board board;
+    Thread *threads;
+    UCIGoStruct ucigo;
+    char str[8192];
+
+    int movetime  = argc > 3 ? atoi(argv[3]) : 100;
+    int nthreads  = argc > 4 ? atoi(argv[4]) :   1;
+    int megabytes = argc > 5 ? atoi(argv[5]) :  16;
+    int rounds    = argc > 6 ? atoi(argv[6]) :   1;
+    CalibratedTime = argc > 7 ? atoi(argv[7]) :   0;
+
+    // The report needs at least one request to summarise
+    if (movetime < 1 || nthreads < 1 || rounds < 1) {
+        fprintf(stderr, "bench latency [movetime=100] [threads=1] [hash=16] [rounds=1] [calibrated=0]\n");
+        fprintf(stderr, "          movetime, threads and rounds must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int npositions = 0, requests = 0;
+    while (strcmp(Benchmarks[npositions], "")) npositions++;
+
+    double *overshoots = malloc(sizeof(double) * npositions * rounds);
+    double totalOvershoot = 0.0;
+
+    threads = createThreadPool(nthreads);
+    tt_init(threads, megabytes);
+
+    for (int round = 0; round < rounds; round++) {
+        for (int i = 0; i < npositions; i++) {
+
+            snprintf(str, sizeof(str), "gp movetime %d fen %s", movetime, Benchmarks[i]);
+
+            const double start = get_real_time();
+            uciGoPosition(&ucigo, threads, &board, 1, str, 0);
+#ifdef ENABLE_MULTITHREAD
+            waitThreadJob(threads);
+#endif
+            const double elapsed = get_real_time() - start;
+
+            // The deadline may have been replaced by the gp hard limit
+            overshoots[requests] = elapsed - ucigo.limits.timeLimit;
+            totalOvershoot += overshoots[requests++];
+        }
+    }
+
+    qsort(overshoots, requests, sizeof(double), compareDoubles);
+
+    // Nearest rank percentiles of the sorted overshoots
+    #define PERCENTILE(p) overshoots[MAX(0, (int) ceil((p) * requests / 100.0) - 1)]
+
+    printf("\n===============================================================================\n");
+    printf("REQUESTS: %39d movetime %8d ms\n", requests, movetime);
+    printf("OVERSHOOT: %35.2f p50 %11.2f mean ms\n", PERCENTILE(50), totalOvershoot / requests);
+    printf("OVERSHOOT: %35.2f p90 %11.2f p99  ms\n", PERCENTILE(90), PERCENTILE(99));
+    printf("OVERSHOOT: %35.2f max %11.2f min  ms\n", overshoots[requests-1], overshoots[0]);
+
+    #undef PERCENTILE
+
+    deleteThreadPool(threads);
+    free(overshoots);
+}
+
+static uint64_t runDeterminismPass(int nthreads, int megabytes, uint64_t nodeLimit, double *elapsed, uint64_t *nodes) {
+
+    // Search every bench position from a fresh Table and Threads, and
+    // fold the results into a single checksum for comparing the runs
+
+    Board board;
+    Limits limits = {0};
+    uint16_t best, ponder; int score;
+    uint64_t checksum = 0ull;
+
+    Thread *threads = createThreadPool(nthreads);
+    tt_init(threads, megabytes);
+    tt_clear(threads);
+
+#ifdef ENABLE_MULTI_PV
+    limits.multiPV        = 1;
+#endif
+    limits.limitedByNodes = 1;
+    limits.nodeLimit      = nodeLimit;
+
+    *elapsed = 0.0, *nodes = 0ull;
+
+    for (int i = 0; strcmp(Benchmarks[i], ""); i++) {
+
+        limits.start = get_real_time();
+        boardFromFEN(&board, Benchmarks[i], 0);
+        getBestMove(threads, &board, &limits, &best, &ponder, &score);
+
+        *elapsed += get_real_time() - limits.start;
+        *nodes   += nodesSearchedThreadPool(threads);
+
+        const uint64_t result = ((uint64_t) best << 48) ^ ((uint64_t) ponder << 32)
+                              ^ ((uint64_t)(uint32_t) score) ^ (nodesSearchedThreadPool(threads) << 16);
+        checksum = (checksum ^ result) * 0x100000001B3ull;
+    }
+
+    deleteThreadPool(threads);
+    return checksum;
+}
+
+static void runDeterminismBenchmark(int argc, char **argv) {
+
+    /// Regression test for the Deterministic mode. The bench positions are searched
+    /// several times with the same Threads, Hash and node limit, which must give the
+    /// same bestmoves, scores and node counts every time. A single Thread search of
+    /// the same node limit is given for comparison of the speed
+
+    double elapsed, baseline;
+    uint64_t checksum, nodes, baseNodes;
+    bool failed = FALSE;
+
+    int nthreads   = argc > 3 ? atoi(argv[3]) :      4;
+    int nodeLimit  = argc > 4 ? atoi(argv[4]) : 200000;
+    int runs       = argc > 5 ? atoi(argv[5]) :      3;
+    int megabytes  = argc > 6 ? atoi(argv[6]) :     16;
+
+    Deterministic = 1;
+    uint64_t expected = runDeterminismPass(nthreads, megabytes, nodeLimit, &elapsed, &nodes);
+    printf("\nRUN %2d: checksum %016"PRIx64" %12"PRIu64" nodes %10.0f ms\n", 1, expected, nodes, elapsed);
+
+    for (int run = 2; run <= runs; run++) {
+        checksum = runDeterminismPass(nthreads, megabytes, nodeLimit, &elapsed, &nodes);
+        printf("\nRUN %2d: checksum %016"PRIx64" %12"PRIu64" nodes %10.0f ms\n", run, checksum, nodes, elapsed);
+        failed |= checksum != expected;
+    }
+
+    Deterministic = 0;
+    runDeterminismPass(1, megabytes, nodeLimit, &baseline, &baseNodes);
+
+    printf("\n===============================================================================\n");
+    printf("SINGLE: %38.0f ms %12.0f nps\n", baseline, 1000.0 * baseNodes / baseline);
+    printf("DETERMINISTIC: %31.0f ms %12.0f nps\n", elapsed, 1000.0 * nodes / elapsed);
+    printf("DETERMINISM: %34s %d threads, %d runs\n", failed ? "FAILED" : "OK", nthreads, runs);
+
+    if (failed) exit(EXIT_FAILURE);
+}
+
+#ifndef _WIN32
+static void runSharedProbes(const char *name) {
+
+    // Attach to the segment without ever searching, so that any Entry which
+    // is found must have been stored by the other process
+
+    Board board; Undo undo;
+    uint16_t moves[MAX_MOVES], move;
+    int value, eval, depth, bound;
+    uint64_t probes = 0ull, hits = 0ull;
+
+    Thread *threads = createThreadPool(1);
+
+    if (!tt_set_shared(threads, name))
+        printf("info string unable to use %s for SharedHash\n", name), exit(EXIT_FAILURE);
+
+    // Probe each position, and every position a single move away from it
+    for (int i = 0; strcmp(Benchmarks[i], ""); i++) {
+
+        boardFromFEN(&board, Benchmarks[i], 0);
+        hits += tt_probe(threads, board.hash, &move, &value, &eval, &depth, &bound), probes++;
+
+        for (int j = 0, size = genAllLegalMoves(&board, moves); j < size; j++) {
+            applyMove(&board, moves[j], &undo);
+            hits += tt_probe(threads, board.hash, &move, &value, &eval, &depth, &bound), probes++;
+            revertMove(&board, moves[j], &undo);
+        }
+    }
+
+    printf("ATTACHED: %38d MB %s\n", tt_megabytes(), name);
+    printf("CROSSHITS: %37.2f %% of %12"PRIu64" probes\n", 100.0 * hits / probes, probes);
+
+    deleteThreadPool(threads);
+    tt_free();
+    exit(hits ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void runSharedBenchmark(int argc, char **argv) {
+
+    /// Check the SharedHash option across two processes. The first searches the bench
+    /// positions with the Table in the named segment, and a second process, forked
+    /// before the segment existed, then attaches to it and probes the same positions.
+    /// Once both have detached, the segment must have been removed again
+
+    Board board;
+    Limits limits = {0};
+    uint16_t best, ponder;
+    int score, status, ready[2];
+    char byte = 0, segment[256];
+
+    const char *name = argc > 3 ? argv[3] : "/ethereal-bench";
+    int depth        = argc > 4 ? atoi(argv[4]) : 10;
+    int megabytes    = argc > 5 ? atoi(argv[5]) : 16;
+
+    snprintf(segment, sizeof(segment), "%s%s", name[0] == '/' ? "" : "/", name);
+
+    // Fork the second process before anything is shared between the two
+    fflush(stdout);
+    if (pipe(ready)) perror("pipe"), exit(EXIT_FAILURE);
+    pid_t pid = fork();
+    if (pid < 0) perror("fork"), exit(EXIT_FAILURE);
+
+    if (pid == 0) {
+        close(ready[1]);
+        if (read(ready[0], &byte, 1) != 1) exit(EXIT_FAILURE);
+        runSharedProbes(segment);
+    }
+
+    close(ready[0]);
+
+    Thread *threads = createThreadPool(1);
+    tt_init(threads, megabytes);
+
+    if (!tt_set_shared(threads, segment)) {
+        printf("info string unable to use %s for SharedHash\n", segment);
+        close(ready[1]), waitpid(pid, &status, 0), exit(EXIT_FAILURE);
+    }
+
+#ifdef ENABLE_MULTI_PV
+    limits.multiPV        = 1;
+#endif
+    limits.limitedByDepth = 1;
+    limits.depthLimit     = depth;
+
+    for (int i = 0; strcmp(Benchmarks[i], ""); i++) {
+        limits.start = get_real_time();
+        boardFromFEN(&board, Benchmarks[i], 0);
+        getBestMove(threads, &board, &limits, &best, &ponder, &score);
+    }
+
+    printf("\n===============================================================================\n");
+    printf("SEARCHED: %38d MB depth %d\n", tt_megabytes(), depth);
+    fflush(stdout);
+
+    // Let the second process attach, while we are still attached ourselves
+    if (write(ready[1], &byte, 1) != 1) perror("write");
+    close(ready[1]);
+    waitpid(pid, &status, 0);
+
+    deleteThreadPool(threads);
+    tt_free();
+
+    // The last process to detach should have removed the segment
+    int fd = shm_open(segment, O_RDONLY, 0600);
+    bool unlinked = fd < 0 && errno == ENOENT;
+    if (fd >= 0) close(fd), shm_unlink(segment);
+
+    printf("UNLINKED: %38s %s\n", unlinked ? "yes" : "no", segment);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) || !unlinked)
+        exit(EXIT_FAILURE);
+}
+#endif
+
+#if USE_NNUE
+static int compareAccumulators(Thread *thread, NNUEEvaluator *scratch) {
+
+    // Evaluate the Board as it stands, and then again with an empty Finny
+    // table and Accumulator stack, which has to build the Accumulators from
+    // the biases. Both evaluations, and both Accumulators, must be equal
+
+    Board *board = &thread->board;
+    NNUEEvaluator *incremental = thread->nnue;
+
+    // KvK is flagged as a draw without touching the Accumulators
+    if (board->pieces[KING] == (board->colours[WHITE] | board->colours[BLACK]))
+        return 0;
+
+    int eval = nnue_evaluate(thread, board);
+
+    nnue_reset_evaluator(scratch);
+    thread->nnue = scratch;
+    int fresh = nnue_evaluate(thread, board);
+    thread->nnue = incremental;
+
+    return eval != fresh
+        || memcmp(incremental->current->values, scratch->current->values, sizeof(scratch->current->values));
+}
+
+static void runNNUEBenchmark(int argc, char **argv) {
+
+    /// Regression test for the incremental NNUE. Random games are played out of each
+    /// bench position, comparing the lazily updated Accumulators against ones built from
+    /// scratch, both while making and unmaking the moves. Then the bench positions are
+    /// searched with incremental updates and again with only refreshes, which must agree.
+    /// The Accumulators met along the way are kept, to time each layer of the Network,
+    /// when built with ENABLE_NNUE_BENCH. See the nnuebench target of the makefile
+
+    Undo undo[MAX_PLY];
+    uint16_t moves[MAX_MOVES], played[MAX_PLY];
+    uint64_t seed = 0x9E3779B97F4A7C15ull, checks = 0ull, mismatches = 0ull;
+    double elapsed, refreshElapsed;
+    uint64_t nodes, refreshNodes;
+    int positions = 0, samples = 0, layerMismatches;
+
+    int nodeLimit = argc > 4 ? atoi(argv[4]) : 200000;
+    int plies     = argc > 5 ? MIN(MAX_PLY, atoi(argv[5])) : 64;
+    int megabytes = argc > 6 ? atoi(argv[6]) : 16;
+    int rounds    = argc > 7 ? atoi(argv[7]) : 20;
+
+    while (strcmp(Benchmarks[positions], "")) positions++;
+    int16_t *accumulators = align_malloc(sizeof(int16_t) * L1SIZE * positions * plies);
+
+    nnue_init(argv[3]);
+    printf("info string set EvalFile to %s\n", argv[3]);
+
+    Thread *threads = createThreadPool(1);
+    NNUEEvaluator *scratch = nnue_create_evaluator();
+    Board *board = &threads->board;
+
+    for (int i = 0; strcmp(Benchmarks[i], ""); i++) {
+
+        int length = 0;
+
+        boardFromFEN(board, Benchmarks[i], 0);
+        board->thread = threads;
+        threads->nnue->current = &threads->nnue->stack[0];
+        threads->nnue->current->accurate[WHITE] = FALSE;
+        threads->nnue->current->accurate[BLACK] = FALSE;
+
+        // Play forward, checking after each move, until the game ends
+        for (; length < plies; length++) {
+
+            int size = genAllLegalMoves(board, moves);
+            if (size == 0) break;
+
+            seed ^= seed << 13, seed ^= seed >> 7, seed ^= seed << 17;
+            played[length] = moves[seed % size];
+
+            applyMove(board, played[length], &undo[length]);
+            mismatches += compareAccumulators(threads, scratch), checks++;
+
+            // Sample both halves, with the side to move first as nnue_evaluate() does
+            NNUEAccumulator *accum = threads->nnue->current;
+            if (accum->accurate[WHITE] && accum->accurate[BLACK]) {
+                memcpy(&accumulators[samples * L1SIZE], accum->values[board->turn], sizeof(int16_t) * KPSIZE);
+                memcpy(&accumulators[samples * L1SIZE + KPSIZE], accum->values[!board->turn], sizeof(int16_t) * KPSIZE);
+                samples++;
+            }
+        }
+
+        // Unwind the game, where the stack should still be accurate
+        while (length-- > 0) {
+            revertMove(board, played[length], &undo[length]);
+            mismatches += compareAccumulators(threads, scratch), checks++;
+        }
+    }
+
+    nnue_delete_evaluator(scratch);
+    deleteThreadPool(threads);
+
+    uint64_t expected = runDeterminismPass(1, megabytes, nodeLimit, &elapsed, &nodes);
+
+    NNUE_FULL_REFRESH = 1;
+    uint64_t checksum = runDeterminismPass(1, megabytes, nodeLimit, &refreshElapsed, &refreshNodes);
+    NNUE_FULL_REFRESH = 0;
+
+    printf("\n===============================================================================\n");
+#ifdef ENABLE_NNUE_BENCH
+    layerMismatches = nnue_benchmark_layers(accumulators, samples, rounds);
+#else
+    layerMismatches = 0, (void)(rounds);
+#endif
+    align_free(accumulators);
+
+    const bool failed = mismatches || layerMismatches || checksum != expected;
+
+    printf("INCREMENTAL: checksum %016"PRIx64" %12"PRIu64" nodes %12.0f nps\n", expected, nodes, 1000.0 * nodes / elapsed);
+    printf("REFRESH:     checksum %016"PRIx64" %12"PRIu64" nodes %12.0f nps\n", checksum, refreshNodes, 1000.0 * refreshNodes / refreshElapsed);
+    printf("ACCUMULATORS: %33"PRIu64" checked %12"PRIu64" differ\n", checks, mismatches);
+#ifdef ENABLE_NNUE_BENCH
+    printf("LAYERS: %39d checked %12d differ\n", samples, layerMismatches);
+#else
+    printf("LAYERS: %39s checked %12s differ\n", "n/a", "n/a");
+#endif
+    printf("NNUE: %41s\n", failed ? "FAILED" : "OK");
+
+    if (failed) exit(EXIT_FAILURE);
+}
+#endif
+
 static void runEvalBook(int argc, char **argv) {
 
     int score;
@@ -134,32 +658,132 @@ static void runEvalBook(int argc, char **argv) {
 #endif
     limits.limitedByDepth = 1;
     limits.depthLimit = depth;
-    tt_init(nthreads, megabytes);
+    tt_init(threads, megabytes);
 
     while ((fgets(line, 256, book)) != NULL) {
         limits.start = get_real_time();
         boardFromFEN(&board, line, 0);
         getBestMove(threads, &board, &limits, &best, &ponder, &score);
-        resetThreadPool(threads); tt_clear(nthreads);
+        resetThreadPool(threads); tt_clear(threads);
         printf("FEN: %s", line);
     }
 
     printf("Time %dms\n", (int)(get_real_time() - start));
 }
 
+#if USE_NNUE
+static void runEvalBatch(int argc, char **argv) {
+
+    /// Label every position in a FEN file with the Network, reading and evaluating
+    /// them in batches across the Thread Pool. Only the time spent evaluating counts
+    /// towards the reported throughput, not reading the file or printing the labels
+
+    enum { BATCH_SIZE = 65536 };
+
+    char line[256];
+    char **fens = malloc(sizeof(char*) * BATCH_SIZE);
+    int *evals  = malloc(sizeof(int) * BATCH_SIZE);
+    uint64_t positions = 0ull;
+    double elapsed = 0.0, start = get_real_time();
+
+    FILE *book   = fopen(argv[3], "r");
+    int nthreads = argc > 4 ? atoi(argv[4]) : 1;
+
+    if (book == NULL)
+        printf("info string Unable to open %s\n", argv[3]), exit(EXIT_FAILURE);
+
+    nnue_init(argv[2]);
+    Thread *threads = createThreadPool(nthreads);
+
+    while (!feof(book)) {
+
+        int count = 0;
+
+        while (count < BATCH_SIZE && fgets(line, 256, book) != NULL) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] != '\0') fens[count++] = strdup(line);
+        }
+
+        double batchStart = get_real_time();
+        nnue_evaluate_batch(threads, (const char **) fens, count, evals);
+        elapsed += get_real_time() - batchStart;
+
+        for (int i = 0; i < count; i++)
+            printf("FEN: %s EVAL: %d\n", fens[i], evals[i]), free(fens[i]);
+
+        positions += count;
+    }
+
+    printf("Positions %"PRIu64" Evaluating %dms (%.0f positions/s) Time %dms\n",
+        positions, (int) elapsed, 1000.0 * positions / MAX(1.0, elapsed), (int)(get_real_time() - start));
+
+    deleteThreadPool(threads);
+    free(fens); free(evals);
+    fclose(book);
+}
+#endif
+
 void handleCommandLine(int argc, char **argv) {
 
     // Output all the wonderful things we can do from the Command Line
     if (argc > 1 && strEquals(argv[1], "--help")) {
         printf("\nbench     [depth=13] [threads=1] [hash=16] [NNUE=None]");
         printf("\n          Run searches on a set of positions to compute a hash\n");
+        printf("\nbench scaling [depth=13] [maxthreads=8] [hash=16] [csv-file=stdout]");
+        printf("\n          Compare time-to-depth and nps over a sweep of thread counts\n");
+        printf("\nbench latency [movetime=100] [threads=1] [hash=16] [rounds=1] [calibrated=0]");
+        printf("\n          Replay positions as gp requests and report deadline overshoots\n");
+        printf("\nbench determinism [threads=4] [nodes=200000] [runs=3] [hash=16]");
+        printf("\n          Check that Deterministic searches repeat exactly, exiting 1 if not\n");
+        printf("\nbench shared [name=/ethereal-bench] [depth=10] [hash=16]");
+        printf("\n          Probe a SharedHash from a second process, exiting 1 if nothing is found\n");
+        printf("\nbench nnue [evalfile] [nodes=200000] [plies=64] [hash=16] [rounds=20]");
+        printf("\n          Check incremental NNUE updates against full refreshes, exiting 1 if not\n");
         printf("\nevalbook  [input-file] [depth=12] [threads=1] [hash=2]");
         printf("\n          Evaluate all positions in a FEN file using various options\n");
+        printf("\nevalbatch [evalfile] [input-file] [threads=1]");
+        printf("\n          Label all positions in a FEN file with the NNUE, reporting positions/s\n");
+        printf("\nnnconvert [input-file] [output-file]");
+        printf("\n          Convert an NNUE file to the format which is mapped as is\n");
         printf("\nnndata    [input-file] [output-file]");
         printf("\n          Build an nndata from a stripped pgn file\n");
         exit(EXIT_SUCCESS);
     }
 
+    // Thread scaling Benchmark is being run from the command line
+    if (argc > 2 && strEquals(argv[1], "bench") && strEquals(argv[2], "scaling")) {
+        runScalingBenchmark(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Determinism regression test is being run from the command line
+    if (argc > 2 && strEquals(argv[1], "bench") && strEquals(argv[2], "determinism")) {
+        runDeterminismBenchmark(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+
+#ifndef _WIN32
+    // SharedHash check across two processes is being run from the command line
+    if (argc > 2 && strEquals(argv[1], "bench") && strEquals(argv[2], "shared")) {
+        runSharedBenchmark(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+#if USE_NNUE
+    // Incremental NNUE regression test is being run from the command line
+    if (argc > 3 && strEquals(argv[1], "bench") && strEquals(argv[2], "nnue")) {
+        runNNUEBenchmark(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+    // Latency Benchmark of gp requests is being run from the command line
+    if (argc > 2 && strEquals(argv[1], "bench") && strEquals(argv[2], "latency")) {
+        runLatencyBenchmark(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+
     // Benchmark is being run from the command line
     if (argc > 1 && strEquals(argv[1], "bench")) {
         runBenchmark(argc, argv);
@@ -172,6 +796,22 @@ void handleCommandLine(int argc, char **argv) {
         exit(EXIT_SUCCESS);
     }
 
+#if USE_NNUE
+    // Label all positions in a datafile with the NNUE alone
+    if (argc > 3 && strEquals(argv[1], "evalbatch")) {
+        runEvalBatch(argc, argv);
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+    // Convert an NNUE file from the trainer into the mappable format
+    if (argc > 3 && strEquals(argv[1], "nnconvert")) {
+        nnue_init(argv[2]);
+        if (!nnue_export(argv[3])) printf("info string Unable to write %s\n", argv[3]), exit(EXIT_FAILURE);
+        printf("info string converted %s to %s\n", argv[2], argv[3]);
+        exit(EXIT_SUCCESS);
+    }
+
     // Convert a PGN file to an nndata file
     // if (argc > 3 && strEquals(argv[1], "nndata")) {
     //     process_pgn(argv[2], argv[3]);
@@ -27,7 +27,7 @@
 #include "move.h"
 #include "masks.h"
 #include "network.h"
-//#include "nnue/nnue.h"
+#include "nnue/nnue.h"
 #include "thread.h"
 #include "transposition.h"
 #include "types.h"
@@ -446,10 +446,10 @@ int evaluateBoard(Thread *thread, Board *board) {
         return -thread->states[thread->height-1].eval + 2 * Tempo;
 
     // Use the NNUE unless we are in an extremely unbalanced position
-    // if (USE_NNUE && abs(ScoreEG(board->psqtmat)) <= 2000) {
-    //     eval = nnue_evaluate(thread, board);
-    //     eval = board->turn == WHITE  ? eval : -eval;
-    // }
+    if (USE_NNUE && NNUE_LOADED && abs(ScoreEG(board->psqtmat)) <= 2000) {
+        eval = nnue_evaluate(thread, board);
+        eval = board->turn == WHITE  ? eval : -eval;
+    }
 
     else {
 
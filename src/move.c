@@ -34,8 +34,8 @@
 #include "uci.h"
 #include "zobrist.h"
 
-// #include "nnue/accumulator.h"
-// #include "nnue/types.h"
+#include "nnue/accumulator.h"
+#include "nnue/types.h"
 
 static inline void updateCastleZobrist(Board *board, uint64_t oldRooks, uint64_t newRooks) {
     uint64_t diff = oldRooks ^ newRooks;
@@ -204,9 +204,9 @@ void applyNormalMove(Board *board, uint16_t move, Undo *undo) {
         }
     }
 
-    // nnue_push(board);
-    // nnue_move_piece(board, fromPiece, from, to);
-    // nnue_remove_piece(board, toPiece, to);
+    nnue_push(board);
+    nnue_move_piece(board, fromPiece, from, to);
+    nnue_remove_piece(board, toPiece, to);
 }
 
 void applyCastleMove(Board *board, uint16_t move, Undo *undo) {
@@ -255,9 +255,9 @@ void applyCastleMove(Board *board, uint16_t move, Undo *undo) {
 
     undo->capturePiece = EMPTY;
 
-    // nnue_push(board);
-    // if (from != to) nnue_move_piece(board, fromPiece, from, to);
-    // if (rFrom != rTo) nnue_move_piece(board, rFromPiece, rFrom, rTo);
+    nnue_push(board);
+    if (from != to) nnue_move_piece(board, fromPiece, from, to);
+    if (rFrom != rTo) nnue_move_piece(board, rFromPiece, rFrom, rTo);
 }
 
 void applyEnpassMove(Board *board, uint16_t move, Undo *undo) {
@@ -298,9 +298,9 @@ void applyEnpassMove(Board *board, uint16_t move, Undo *undo) {
     assert(pieceType(fromPiece) == PAWN);
     assert(pieceType(enpassPiece) == PAWN);
 
-    // nnue_push(board);
-    // nnue_move_piece(board, fromPiece, from, to);
-    // nnue_remove_piece(board, enpassPiece, ep);
+    nnue_push(board);
+    nnue_move_piece(board, fromPiece, from, to);
+    nnue_remove_piece(board, enpassPiece, ep);
 }
 
 void applyPromotionMove(Board *board, uint16_t move, Undo *undo) {
@@ -347,10 +347,10 @@ void applyPromotionMove(Board *board, uint16_t move, Undo *undo) {
     assert(pieceType(toPiece) != PAWN);
     assert(pieceType(toPiece) != KING);
 
-    // nnue_push(board);
-    // nnue_remove_piece(board, fromPiece, from);
-    // nnue_remove_piece(board, toPiece, to);
-    // nnue_add_piece(board, promoPiece, to);
+    nnue_push(board);
+    nnue_remove_piece(board, fromPiece, from);
+    nnue_remove_piece(board, toPiece, to);
+    nnue_add_piece(board, promoPiece, to);
 }
 
 void applyNullMove(Board *board, Undo *undo) {
@@ -397,7 +397,7 @@ void revertMove(Board *board, uint16_t move, Undo *undo) {
     board->fullMoveCounter--;
 
     // Update Accumulator pointer
-    //nnue_pop(board);
+    nnue_pop(board);
 
     if (MoveType(move) == NORMAL_MOVE) {
 
@@ -31,9 +31,9 @@
 #include "../types.h"
 
 
-static const int Mirror[] = { 3, 2, 1, 0, 0, 1, 2, 3 };
+static const int HalfMirror[] = { 3, 2, 1, 0, 0, 1, 2, 3 };
 static int sq64_to_sq32(int sq) {
-    return ((sq >> 1) & ~0x3) + Mirror[sq & 0x7];
+    return ((sq >> 1) & ~0x3) + HalfMirror[sq & 0x7];
 }
 
 static int nnue_index(int piece, int relksq, int colour, int sq) {
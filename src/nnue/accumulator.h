@@ -20,6 +20,9 @@
 
 #pragma once
 
+#include <string.h>
+
+#include "nnue.h"
 #include "types.h"
 #include "utils.h"
 
@@ -27,13 +30,8 @@
 #include "../thread.h"
 #include "../types.h"
 
-extern ALIGN64 int16_t in_weights[INSIZE * KPSIZE];
-extern ALIGN64 int16_t in_biases[KPSIZE];
-
-#if 0
-INLINE NNUEEvaluator* nnue_create_evaluator() {
-    return align_malloc(sizeof(NNUEEvaluator));
-}
+extern int16_t *in_weights;
+extern int16_t *in_biases;
 
 INLINE void nnue_reset_evaluator(NNUEEvaluator* ptr) {
 
@@ -51,21 +49,31 @@ INLINE void nnue_reset_evaluator(NNUEEvaluator* ptr) {
         ptr->current->accurate[WHITE] = 0;
         ptr->current->accurate[BLACK] = 0;
 
+    #else
+        (void) ptr;
     #endif
 }
 
+INLINE NNUEEvaluator* nnue_create_evaluator() {
+    NNUEEvaluator *ptr = align_malloc(sizeof(NNUEEvaluator));
+    nnue_reset_evaluator(ptr);
+    return ptr;
+}
+
 INLINE void nnue_delete_evaluator(NNUEEvaluator* ptr) {
     align_free(ptr);
 }
 
+/// Boards tied to a Thread record each move for the Accumulators, but only
+/// when a Network is loaded, as otherwise the Accumulators are never read
 
 INLINE void nnue_pop(Board *board) {
-    if (USE_NNUE && board->thread != NULL)
+    if (USE_NNUE && NNUE_LOADED && board->thread != NULL)
         --board->thread->nnue->current;
 }
 
 INLINE void nnue_push(Board *board) {
-    if (USE_NNUE && board->thread != NULL) {
+    if (USE_NNUE && NNUE_LOADED && board->thread != NULL) {
         NNUEAccumulator *accum = ++board->thread->nnue->current;
         accum->accurate[WHITE] = accum->accurate[BLACK] = FALSE;
         accum->changes = 0;
@@ -73,7 +81,7 @@ INLINE void nnue_push(Board *board) {
 }
 
 INLINE void nnue_move_piece(Board *board, int piece, int from, int to) {
-    if (USE_NNUE && board->thread != NULL) {
+    if (USE_NNUE && NNUE_LOADED && board->thread != NULL) {
         NNUEAccumulator *accum = board->thread->nnue->current;
         accum->deltas[accum->changes++] = (NNUEDelta) { piece, from, to };
     }
@@ -91,4 +99,3 @@ INLINE void nnue_remove_piece(Board *board, int piece, int sq) {
 int nnue_can_update(NNUEAccumulator *accum, Board *board, int colour);
 void nnue_update_accumulator(NNUEAccumulator *accum, Board *board, int colour, int relksq);
 void nnue_refresh_accumulator(NNUEEvaluator *nnue, NNUEAccumulator *accum, Board *board, int colour, int relksq);
-#endif
\ No newline at end of file
@@ -44,6 +44,10 @@
 #define vepi32_max  _mm256_max_epi32
 #define vepi32_hadd _mm256_hadd_epi32
 #define vepi32_zero _mm256_setzero_si256
+#define vepi32_set1 _mm256_set1_epi32
+
+// Bitmask of the 32-bit lanes which are not zero
+#define vepi32_nnz(A) (0xFF ^ _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(A, vepi32_zero()))))
 
 #define vps32_add  _mm256_add_ps
 #define vps32_mul  _mm256_mul_ps
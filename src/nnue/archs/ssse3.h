@@ -44,6 +44,10 @@
 #define vepi32_max  (void)
 #define vepi32_hadd _mm_hadd_epi32
 #define vepi32_zero _mm_setzero_si128
+#define vepi32_set1 _mm_set1_epi32
+
+// Bitmask of the 32-bit lanes which are not zero
+#define vepi32_nnz(A) (0xF ^ _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(A, vepi32_zero()))))
 
 #define vps32_add  _mm_add_ps
 #define vps32_mul  _mm_mul_ps
@@ -25,6 +25,13 @@
 #include <string.h>
 #include <stdalign.h>
 
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 #include "accumulator.h"
 #include "nnue.h"
 #include "types.h"
@@ -34,6 +41,7 @@
 #include "../board.h"
 #include "../evaluate.h"
 #include "../thread.h"
+#include "../timeman.h"
 
 #include "../incbin/incbin.h"
 
@@ -45,17 +53,31 @@ const char *NNUEDefault = EVALFILE;
 INCBIN(IncWeights, EVALFILE);
 #endif
 
-ALIGN64 int16_t in_weights[INSIZE * KPSIZE ];
-ALIGN64 int8_t  l1_weights[L1SIZE * L2SIZE ];
-ALIGN64 float   l2_weights[L2SIZE * L3SIZE ];
-ALIGN64 float   l3_weights[L3SIZE * OUTSIZE];
+// Networks read from the raw trainer output are permuted into our own Storage.
+// Converted Networks are mapped read-only instead, so that every process using
+// the same file shares a single copy of it through the page cache
+
+static NNUENetwork Storage;
+static NNUENetwork *Network = &Storage;
+static NNUENetwork *Mapping = NULL;
 
-ALIGN64 int16_t in_biases[KPSIZE ];
-ALIGN64 int32_t l1_biases[L2SIZE ];
-ALIGN64 float   l2_biases[L3SIZE ];
-ALIGN64 float   l3_biases[OUTSIZE];
+int16_t *in_weights = Storage.in_weights;
+int8_t  *l1_weights = Storage.l1_weights;
+float   *l2_weights = Storage.l2_weights;
+float   *l3_weights = Storage.l3_weights;
 
-static int NNUE_LOADED = 0;
+int16_t *in_biases  = Storage.in_biases;
+int32_t *l1_biases  = Storage.l1_biases;
+float   *l2_biases  = Storage.l2_biases;
+float   *l3_biases  = Storage.l3_biases;
+
+int NNUE_LOADED = 0;
+int NNUE_FULL_REFRESH = 0;
+
+#ifdef ENABLE_NNUE_BENCH
+// Offsets of the set bits of each 8-bit mask, in order
+static ALIGN64 uint16_t NNZLookup[256][8];
+#endif
 
 static void scale_weights() {
 
@@ -100,6 +122,19 @@ static void float_transpose(float *matrix, int rows, int cols) {
     free(cpy);
 }
 
+#ifdef ENABLE_NNUE_BENCH
+static void sparse_transpose(int8_t *matrix, int8_t *sparse) {
+
+    // Regroup the transposed L1 weights by columns of four inputs, so that
+    // each non-zero 4-byte chunk of the input selects L2SIZE * 4 contiguous
+    // weights, of which each 32-bit lane holds the four for a single output
+
+    for (int i = 0; i < L1SIZE; i++)
+        for (int j = 0; j < L2SIZE; j++)
+            sparse[(i / 4) * L2SIZE * 4 + j * 4 + i % 4] = matrix[j * L1SIZE + i];
+}
+#endif
+
 static void shuffle_input_layer() {
 
     #if defined(USE_AVX2)
@@ -235,8 +270,7 @@ INLINE void halfkp_relu_quant_affine_relu(int8_t *weights, int32_t *biases, int1
         __m128 ps0 = _mm_cvtepi32_ps(vepi32_max(zero, vepi32_add(bia[i * 2 + 0], acc0)));
         __m128 ps1 = _mm_cvtepi32_ps(vepi32_max(zero, vepi32_add(bia[i * 2 + 1], acc4)));
 
-        out[i] = _mm256_insertf128_ps(out[i], ps0, 0);
-        out[i] = _mm256_insertf128_ps(out[i], ps1, 1);
+        out[i] = _mm256_insertf128_ps(_mm256_castps128_ps256(ps0), ps1, 1);
 
         #elif defined (USE_SSSE3)
 
@@ -247,6 +281,104 @@ INLINE void halfkp_relu_quant_affine_relu(int8_t *weights, int32_t *biases, int1
     }
 }
 
+#ifdef ENABLE_NNUE_BENCH
+INLINE void halfkp_relu_quant_sparse_affine_relu(int8_t *weights, int32_t *biases, int16_t *us_accum, int16_t *opp_accum, float *outputs) {
+
+    /// The same layer as above, but after the clipped ReLU much of the input is
+    /// zero. So the input is packed in full first, collecting the indices of the
+    /// non-zero 4-byte chunks, and only the columns of weights for those are read.
+    /// With just L2SIZE outputs the dense kernel is cheap per chunk, and this one
+    /// only wins when very few chunks are non-zero. "bench nnue" compares the two
+
+    assert(L1SIZE == KPSIZE * 2 && L2SIZE * 4 % vepi8_cnt == 0);
+
+    enum { Regs = L2SIZE * 4 / vepi8_cnt };
+
+    const int InChunks = KPSIZE / vepi8_cnt;
+
+    ALIGN64 uint8_t  inputs[L1SIZE];
+    ALIGN64 uint16_t nnz[L1SIZE / 4 + 8];
+    vepi32 acc[Regs];
+    int count = 0;
+
+    #if defined(USE_AVX2) || defined(USE_AVX)
+    const vepi32 zero = vepi32_zero();
+    #elif defined(USE_SSSE3)
+    const vps32  zero = vps32_zero();
+    #endif
+
+    const vepi16  *us     = (vepi16  *) us_accum;
+    const vepi16  *opp    = (vepi16  *) opp_accum;
+    const vepi8   *wgt    = (vepi8   *) weights;
+    const vepi32  *bia    = (vepi32  *) biases;
+    const int32_t *chunks = (int32_t *) inputs;
+    vepi8 *const packed   = (vepi8   *) inputs;
+    vps32 *const out      = (vps32   *) outputs;
+
+    // Without branching, append the indices of all of the non-zero chunks. Eight
+    // are always written, but only as many as there are bits in the mask are kept
+
+    __m128i base = _mm_setzero_si128();
+    const __m128i step = _mm_set1_epi16(vepi32_cnt);
+
+    for (int j = 0; j < InChunks * 2; j++) {
+
+        const vepi16 *inp = j < InChunks ? &us[j * 2] : &opp[(j - InChunks) * 2];
+        const int nonzero = vepi32_nnz(packed[j] = vepi16_relu_packu(inp[0], inp[1]));
+        const __m128i offsets = _mm_load_si128((__m128i *) NNZLookup[nonzero]);
+
+        _mm_storeu_si128((__m128i *) &nnz[count], _mm_add_epi16(base, offsets));
+        count += popcount(nonzero), base = _mm_add_epi16(base, step);
+    }
+
+    for (int r = 0; r < Regs; r++)
+        acc[r] = bia[r];
+
+    // Pairs of chunks are summed in 16-bits before widening, as the dense kernel
+    // sums four, which only halves the headroom it already relies upon
+
+    int i = 0;
+
+    for (; i + 1 < count; i += 2) {
+
+        const vepi8 inp0 = vepi32_set1(chunks[nnz[i+0]]);
+        const vepi8 inp1 = vepi32_set1(chunks[nnz[i+1]]);
+
+        for (int r = 0; r < Regs; r++) {
+            vepi16 sum0 = vepi16_maubs(inp0, wgt[nnz[i+0] * Regs + r]);
+            vepi16 sum1 = vepi16_maubs(inp1, wgt[nnz[i+1] * Regs + r]);
+            acc[r] = vepi32_add(acc[r], vepi16_madd(vepi16_one, vepi16_add(sum0, sum1)));
+        }
+    }
+
+    for (; i < count; i++) {
+
+        const vepi8 inp = vepi32_set1(chunks[nnz[i]]);
+
+        for (int r = 0; r < Regs; r++)
+            acc[r] = vepi32_add(acc[r], vepi16_madd(vepi16_one, vepi16_maubs(inp, wgt[nnz[i] * Regs + r])));
+    }
+
+    #if defined(USE_AVX2)
+
+    out[0] = _mm256_cvtepi32_ps(vepi32_max(zero, acc[0]));
+
+    #elif defined (USE_AVX)
+
+    __m128 ps0 = _mm_cvtepi32_ps(vepi32_max(zero, acc[0]));
+    __m128 ps1 = _mm_cvtepi32_ps(vepi32_max(zero, acc[1]));
+
+    out[0] = _mm256_insertf128_ps(_mm256_castps128_ps256(ps0), ps1, 1);
+
+    #elif defined (USE_SSSE3)
+
+    out[0] = vps32_max(zero, _mm_cvtepi32_ps(acc[0]));
+    out[1] = vps32_max(zero, _mm_cvtepi32_ps(acc[1]));
+
+    #endif
+}
+#endif
+
 INLINE void float_affine_relu(float *weights, float *biases, float *inputs, float *outputs) {
 
     assert(L2SIZE % 8 == 0 && L3SIZE % 8 == 0);
@@ -348,13 +480,106 @@ INLINE void output_transform(float *weights, float *biases, float *inputs, float
 }
 
 
+static NNUEHeader nnue_header() {
+
+    NNUEHeader header = {
+        .magic   = NNUE_MAGIC,
+        .version = NNUE_VERSION,
+        .layout  = NNUE_LAYOUT,
+        .sizes   = { INSIZE, KPSIZE, L1SIZE, L2SIZE, L3SIZE, OUTSIZE },
+    };
+
+    return header;
+}
+
+static void nnue_use(NNUENetwork *network) {
+
+    // Point the kernels at the weights of the given Network, and
+    // release the previous mapping once it is no longer in use
+
+    in_weights = network->in_weights, in_biases = network->in_biases;
+    l1_weights = network->l1_weights, l1_biases = network->l1_biases;
+    l2_weights = network->l2_weights, l2_biases = network->l2_biases;
+    l3_weights = network->l3_weights, l3_biases = network->l3_biases;
+
+#ifndef _WIN32
+    if (Mapping != NULL && Mapping != network)
+        munmap(Mapping, sizeof(NNUENetwork));
+#endif
+
+    Mapping = network == &Storage ? NULL : network;
+    Network = network;
+}
+
+static NNUENetwork *nnue_map(FILE *fin) {
+
+#ifndef _WIN32
+
+    /// Map a converted Network read-only. Nothing is read until the first
+    /// evaluations touch the weights, so this is constant-time regardless
+    /// of the size of the Network, and the pages are shared between processes
+
+    struct stat st;
+
+    if (fstat(fileno(fin), &st) || (size_t) st.st_size != sizeof(NNUENetwork))
+        abort_nnue("NNUE File has the wrong size");
+
+    void *mapping = mmap(NULL, sizeof(NNUENetwork), PROT_READ, MAP_SHARED, fileno(fin), 0);
+    if (mapping == MAP_FAILED)
+        abort_nnue("Unable to map NNUE File");
+
+    return (NNUENetwork*) mapping;
+
+#else
+
+    // Without mmap() we settle for reading the file into Storage
+    rewind(fin);
+    nnue_use(&Storage);
+
+    if (fread(&Storage, sizeof(NNUENetwork), 1, fin) != 1)
+        abort_nnue("Unable to read NNUE File");
+
+    return &Storage;
+
+#endif
+}
+
 void nnue_init(const char* fname) {
 
-    // Reads an NNUE file specificed by a User. If the datasize does not match
-    // the compiled NNUE configuration, abort. Afterwords, scale some weights
-    // for speed optimizations, and transpose the weights in L1 and L2
+    // Reads an NNUE file specificed by a User. Converted files are mapped as they
+    // are. Otherwise, if the datasize does not match the compiled NNUE config, abort.
+    // Afterwords, scale some weights for speed optimizations, and transpose the
+    // weights in L1 and L2. A NULL file unloads the Network, returning to Classical
+
+    FILE *fin;
+    NNUEHeader header, expected = nnue_header();
 
-    FILE *fin = fopen(fname, "rb");
+    if (fname == NULL) {
+        nnue_use(&Storage);
+        NNUE_LOADED = 0;
+        return;
+    }
+
+    if ((fin = fopen(fname, "rb")) == NULL)
+        abort_nnue("Unable to open NNUE File");
+
+    // Converted files identify themselves, and must match the build exactly
+    if (   fread(&header, sizeof(NNUEHeader), 1, fin) == 1
+        && !memcmp(header.magic, expected.magic, sizeof(header.magic))) {
+
+        if (memcmp(&header, &expected, sizeof(NNUEHeader)))
+            abort_nnue("NNUE File was converted for a different build");
+
+        nnue_use(nnue_map(fin));
+        fclose(fin);
+
+        NNUE_LOADED = 1;
+        return;
+    }
+
+    rewind(fin);
+    nnue_use(&Storage);
+    Storage.header = expected;
 
     if (   fread(in_biases, sizeof(int16_t), KPSIZE, fin) != (size_t) KPSIZE
         || fread(in_weights, sizeof(int16_t), INSIZE * KPSIZE, fin) != (size_t) INSIZE * KPSIZE)
@@ -391,6 +616,9 @@ void nnue_incbin_init() {
 
     int8_t *data8; int16_t *data16; int32_t *data32; float *dataf;
 
+    nnue_use(&Storage);
+    Storage.header = nnue_header();
+
     // Input layer uses 16-bit Biases and Weights
 
     data16 = (int16_t*) gIncWeightsData;
@@ -437,6 +665,20 @@ void nnue_incbin_init() {
     #endif
 }
 
+bool nnue_export(const char *fname) {
+
+    // Write the loaded Network in the converted format, which is no more than
+    // the weights in memory, already scaled, shuffled, and transposed as needed
+
+    FILE *fout;
+
+    if (!NNUE_LOADED || (fout = fopen(fname, "wb")) == NULL)
+        return FALSE;
+
+    bool written = fwrite(Network, sizeof(NNUENetwork), 1, fout) == 1;
+    return (fclose(fout) == 0) && written;
+}
+
 int nnue_evaluate(Thread *thread, Board *board) {
 
     int mg_eval, eg_eval;
@@ -462,7 +704,7 @@ int nnue_evaluate(Thread *thread, Board *board) {
     if (!accum->accurate[WHITE]) {
 
         // Possible to recurse and incrementally update each
-        if (nnue_can_update(accum, board, WHITE))
+        if (!NNUE_FULL_REFRESH && nnue_can_update(accum, board, WHITE))
             nnue_update_accumulator(accum, board, WHITE, wrelksq);
 
         // History is missing, we must refresh completely
@@ -473,7 +715,7 @@ int nnue_evaluate(Thread *thread, Board *board) {
     if (!accum->accurate[BLACK]) {
 
         // Possible to recurse and incrementally update each
-        if (nnue_can_update(accum, board, BLACK))
+        if (!NNUE_FULL_REFRESH && nnue_can_update(accum, board, BLACK))
             nnue_update_accumulator(accum, board, BLACK, brelksq);
 
         // History is missing, we must refresh completely
@@ -495,3 +737,151 @@ int nnue_evaluate(Thread *thread, Board *board) {
     eg_eval = MAX(-2000, MIN(2000, eg_eval));
     return MakeScore(mg_eval, eg_eval);
 }
+
+typedef struct NNUEBatchSlice {
+    Thread *thread;
+    const char **fens;
+    int *out, length;
+} NNUEBatchSlice;
+
+static void *nnue_evaluate_slice(void *vslice) {
+
+    NNUEBatchSlice *slice = (NNUEBatchSlice*) vslice;
+    Thread *thread = slice->thread;
+    Board *board = &thread->board;
+
+    for (int i = 0; i < slice->length; i++) {
+
+        boardFromFEN(board, slice->fens[i], 0);
+        board->thread = thread;
+
+        // Nothing on the stack relates to this position, but the Finny table might
+        thread->nnue->current = &thread->nnue->stack[0];
+        thread->nnue->current->accurate[WHITE] = FALSE;
+        thread->nnue->current->accurate[BLACK] = FALSE;
+
+        const int eval  = nnue_evaluate(thread, board);
+        const int phase = 4 * popcount(board->pieces[QUEEN ])
+                        + 2 * popcount(board->pieces[ROOK  ])
+                        + 1 * popcount(board->pieces[KNIGHT] | board->pieces[BISHOP]);
+
+        slice->out[i] = (ScoreMG(eval) * phase + ScoreEG(eval) * (24 - phase)) / 24;
+    }
+
+    return NULL;
+}
+
+void nnue_evaluate_batch(Thread *threads, const char **fens, int n, int *out) {
+
+    /// Evaluate n unrelated positions with the Network, from the side to move's view
+    /// and interpolated by phase as evaluateBoard() would. Each Thread of the idle Pool
+    /// takes a contiguous slice, which keeps consecutive positions of a game together,
+    /// so that most are a move or two away from an entry in that Thread's Finny table
+
+    const int nthreads = threads->nthreads;
+    NNUEBatchSlice *slices = malloc(sizeof(NNUEBatchSlice) * nthreads);
+
+    for (int i = 0, begin = 0; i < nthreads; i++) {
+        const int end = (int) ((int64_t) n * (i + 1) / nthreads);
+        slices[i] = (NNUEBatchSlice) { &threads[i], &fens[begin], &out[begin], end - begin };
+        begin = end;
+    }
+
+#ifdef ENABLE_MULTITHREAD
+    for (int i = 0; i < nthreads; i++)
+        startThreadJob(&threads[i], &nnue_evaluate_slice, &slices[i]);
+    waitThreadPool(threads);
+#else
+    for (int i = 0; i < nthreads; i++)
+        nnue_evaluate_slice(&slices[i]);
+#endif
+
+    free(slices);
+}
+
+#ifdef ENABLE_NNUE_BENCH
+int nnue_benchmark_layers(int16_t *samples, int count, int rounds) {
+
+    /// Time each layer of the forward pass alone, over Accumulators sampled from
+    /// real positions, each stored as the side to move's half followed by the other.
+    /// Returns the number of samples for which the two L1 kernels do not agree.
+    /// The sparse L1 kernel is not used by nnue_evaluate(), so it and its tables
+    /// are only built into binaries compiled with ENABLE_NNUE_BENCH
+
+    ALIGN64 float dense[L2SIZE];
+    int8_t *l1_sparse = align_malloc(sizeof(int8_t) * L1SIZE * L2SIZE);
+    float *outN1 = align_malloc(sizeof(float) * count * L2SIZE);
+    float *outN2 = align_malloc(sizeof(float) * count * L3SIZE);
+    float *outN3 = align_malloc(sizeof(float) * count * OUTSIZE);
+    uint64_t nonzero = 0ull; int mismatches = 0;
+    double start, elapsed[4];
+
+    // Build the lookup from masks of non-zero chunks to their offsets,
+    // used by halfkp_relu_quant_sparse_affine_relu() to gather indices
+    for (int mask = 0; mask < 256; mask++)
+        for (int bits = mask, n = 0; bits; bits &= bits - 1)
+            NNZLookup[mask][n++] = getlsb(bits);
+
+    sparse_transpose(l1_weights, l1_sparse);
+
+    // Check the kernels against each other, and count non-zero input chunks. Groups
+    // of four 16-bit values are never split up by shuffle_input_layer(), so the
+    // chunks can be found in the Accumulators without packing them first
+
+    for (int i = 0; i < count; i++) {
+
+        int16_t *us = &samples[i * L1SIZE], *opp = &samples[i * L1SIZE + KPSIZE];
+
+        halfkp_relu_quant_affine_relu(l1_weights, l1_biases, us, opp, dense);
+        halfkp_relu_quant_sparse_affine_relu(l1_sparse, l1_biases, us, opp, &outN1[i * L2SIZE]);
+        mismatches += memcmp(dense, &outN1[i * L2SIZE], sizeof(dense)) != 0;
+
+        for (int j = i * L1SIZE; j < (i + 1) * L1SIZE; j += 4)
+            nonzero +=  (samples[j+0] >> SHIFT_L0) > 0 || (samples[j+1] >> SHIFT_L0) > 0
+                     || (samples[j+2] >> SHIFT_L0) > 0 || (samples[j+3] >> SHIFT_L0) > 0;
+    }
+
+    // Time blocks of samples small enough to stay in cache, as the Accumulators
+    // would be during a search, while still too many for the branch predictors
+    // to learn. The outputs of each layer are kept as the inputs of the next
+
+    for (int layer = 0; layer < 4; layer++) {
+
+        start = get_real_time();
+
+        for (int block = 0; block < count; block += 64) {
+            for (int r = 0; r < rounds; r++) {
+                for (int i = block; i < MIN(count, block + 64); i++) {
+
+                    int16_t *us = &samples[i * L1SIZE], *opp = &samples[i * L1SIZE + KPSIZE];
+
+                    if (layer == 0)
+                        halfkp_relu_quant_affine_relu(l1_weights, l1_biases, us, opp, &outN1[i * L2SIZE]);
+
+                    else if (layer == 1)
+                        halfkp_relu_quant_sparse_affine_relu(l1_sparse, l1_biases, us, opp, &outN1[i * L2SIZE]);
+
+                    else if (layer == 2)
+                        float_affine_relu(l2_weights, l2_biases, &outN1[i * L2SIZE], &outN2[i * L3SIZE]);
+
+                    else
+                        output_transform(l3_weights, l3_biases, &outN2[i * L3SIZE], &outN3[i * OUTSIZE]);
+                }
+            }
+        }
+
+        elapsed[layer] = get_real_time() - start;
+    }
+
+    const double evals = 1e-6 * rounds * count;
+
+    printf("L1 DENSE:  %36.1f ns/eval\n", elapsed[0] / evals);
+    printf("L1 SPARSE: %36.1f ns/eval %6.1f%% non-zero\n", elapsed[1] / evals, 100.0 * nonzero / (count * L1SIZE / 4));
+    printf("L2:        %36.1f ns/eval\n", elapsed[2] / evals);
+    printf("L3:        %36.1f ns/eval\n", elapsed[3] / evals);
+
+    align_free(l1_sparse);
+    align_free(outN1); align_free(outN2); align_free(outN3);
+    return mismatches;
+}
+#endif
@@ -20,26 +20,48 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdio.h>
+
 #include "../types.h"
 
 #if USE_NNUE
 
+extern int NNUE_LOADED;       // Set once a Network has been read
+extern int NNUE_FULL_REFRESH; // Skip incremental updates, for verification
+
 void nnue_init(const char* fname);
 void nnue_incbin_init();
+bool nnue_export(const char *fname);
 int nnue_evaluate(Thread *thread, Board *board);
+void nnue_evaluate_batch(Thread *threads, const char **fens, int n, int *out);
+
+#ifdef ENABLE_NNUE_BENCH
+int nnue_benchmark_layers(int16_t *samples, int count, int rounds);
+#endif
 
 #else
 
+#define NNUE_LOADED 0
+
 INLINE void nnue_init(const char* fname) {
-    (void) fname; printf("info string Error: NNUE is disabled for this binary\n");
+    if (fname != NULL) printf("info string Error: NNUE is disabled for this binary\n");
 }
 
 INLINE void nnue_incbin_init() {
     (void) 0;
 };
 
+INLINE bool nnue_export(const char *fname) {
+    (void) fname; return FALSE;
+}
+
 INLINE int nnue_evaluate(Thread *thread, Board * board) {
     (void) thread; (void) board; return 0;
 }
 
+INLINE void nnue_evaluate_batch(Thread *threads, const char **fens, int n, int *out) {
+    (void) threads; (void) fens; for (int i = 0; i < n; i++) out[i] = 0;
+}
+
 #endif
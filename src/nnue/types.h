@@ -41,6 +41,18 @@
 
 #define NUM_REGS 16
 
+// Weights of a converted Network are stored already permuted for the kernels,
+// which differ in whether the 128-bit halves of the input layer are interleaved
+
+#define NNUE_MAGIC   "ETHNNUE"
+#define NNUE_VERSION 1
+
+#if defined(USE_AVX2)
+    #define NNUE_LAYOUT 2
+#else
+    #define NNUE_LAYOUT 1
+#endif
+
 typedef struct NNUEDelta {
     int piece, from, to;
 } NNUEDelta;
@@ -56,6 +68,25 @@ typedef struct NNUEAccumulatorTableEntry {
     uint64_t occupancy[COLOUR_NB][COLOUR_NB][PIECE_NB-1];
 } NNUEAccumulatorTableEntry;
 
+typedef struct NNUEHeader {
+    char magic[8];     // NNUE_MAGIC, which the raw trainer output lacks
+    uint32_t version;  // NNUE_VERSION of the converted format
+    uint32_t layout;   // NNUE_LAYOUT of the binary that converted the Network
+    uint32_t sizes[6]; // INSIZE, KPSIZE, L1SIZE, L2SIZE, L3SIZE, OUTSIZE
+} NNUEHeader;
+
+typedef struct NNUENetwork {
+    ALIGN64 NNUEHeader header;
+    ALIGN64 int16_t in_biases[KPSIZE];
+    ALIGN64 int16_t in_weights[INSIZE * KPSIZE];
+    ALIGN64 int32_t l1_biases[L2SIZE];
+    ALIGN64 int8_t  l1_weights[L1SIZE * L2SIZE];
+    ALIGN64 float   l2_biases[L3SIZE];
+    ALIGN64 float   l2_weights[L2SIZE * L3SIZE];
+    ALIGN64 float   l3_biases[OUTSIZE];
+    ALIGN64 float   l3_weights[L3SIZE * OUTSIZE];
+} NNUENetwork;
+
 typedef struct NNUEEvaluator {
     NNUEAccumulator stack[MAX_PLY + 4];         // Each ply of search
     NNUEAccumulator *current;                   // Pointer of the current stack location
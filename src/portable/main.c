@@ -0,0 +1,150 @@
+/*
+  Ethereal is a UCI chess playing engine authored by Andrew Grant.
+  <https://github.com/AndyGrant/Ethereal>     <andrew@grantnet.us>
+
+  Ethereal is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Ethereal is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Entry point of the portable build. Each release configuration of Ethereal is
+// compiled in full and linked into this one executable, with its main() renamed
+// and every other symbol hidden. At startup, we pick the fastest configuration
+// the processor supports, so that no function pays for dispatching on each call
+
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct CPUFeatures {
+    bool popcnt, ssse3, avx, avx2, bmi2, fastpext;
+} CPUFeatures;
+
+typedef struct Configuration {
+    const char *name;
+    int (*main)(int argc, char **argv);
+    bool (*supported)(const CPUFeatures *cpu);
+} Configuration;
+
+int ethereal_avx2_pext(int argc, char **argv);
+int ethereal_avx2_popcnt(int argc, char **argv);
+int ethereal_avx_pext(int argc, char **argv);
+int ethereal_avx_popcnt(int argc, char **argv);
+int ethereal_ssse3_pext(int argc, char **argv);
+int ethereal_ssse3_popcnt(int argc, char **argv);
+int ethereal_generic(int argc, char **argv);
+
+static bool avx2Pext(const CPUFeatures *cpu)    { return cpu->avx2  && cpu->fastpext && cpu->popcnt; }
+static bool avx2Popcnt(const CPUFeatures *cpu)  { return cpu->avx2  && cpu->popcnt; }
+static bool avxPext(const CPUFeatures *cpu)     { return cpu->avx   && cpu->fastpext && cpu->popcnt; }
+static bool avxPopcnt(const CPUFeatures *cpu)   { return cpu->avx   && cpu->popcnt; }
+static bool ssse3Pext(const CPUFeatures *cpu)   { return cpu->ssse3 && cpu->fastpext && cpu->popcnt; }
+static bool ssse3Popcnt(const CPUFeatures *cpu) { return cpu->ssse3 && cpu->popcnt; }
+static bool generic(const CPUFeatures *cpu)     { (void) cpu; return true; }
+
+// Ordered from the most to the least capable, with the fallback last
+static const Configuration Configurations[] = {
+    { "avx2-pext",    ethereal_avx2_pext,    avx2Pext    },
+    { "avx2-popcnt",  ethereal_avx2_popcnt,  avx2Popcnt  },
+    { "avx-pext",     ethereal_avx_pext,     avxPext     },
+    { "avx-popcnt",   ethereal_avx_popcnt,   avxPopcnt   },
+    { "ssse3-pext",   ethereal_ssse3_pext,   ssse3Pext   },
+    { "ssse3-popcnt", ethereal_ssse3_popcnt, ssse3Popcnt },
+    { "generic",      ethereal_generic,      generic     },
+};
+
+enum { CONFIGURATION_NB = sizeof(Configurations) / sizeof(Configurations[0]) };
+
+static uint64_t xgetbv() {
+    uint32_t eax, edx;
+    __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((uint64_t) edx << 32) | eax;
+}
+
+static CPUFeatures detectFeatures() {
+
+    /// Read the features from cpuid. AVX also needs the OS to save the YMM
+    /// registers, as reported by XCR0. PEXT is microcoded on Zen and Zen 2
+    /// (family 0x17), where the magic bitboards are faster, as in the makefile
+
+    CPUFeatures cpu = {0};
+    uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0, vendor[3];
+
+    if (!__get_cpuid(0, &eax, &vendor[0], &vendor[2], &vendor[1]))
+        return cpu;
+
+    const uint32_t maxLeaf = eax;
+
+    __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    const uint32_t family = ((eax >> 8) & 0xF) + ((eax >> 20) & 0xFF);
+    const bool ymm = ((ecx >> 27) & 1) && (xgetbv() & 0x6) == 0x6;
+    const bool fma = (ecx >> 12) & 1;
+
+    cpu.ssse3  = (ecx >>  9) & 1;
+    cpu.popcnt = (ecx >> 23) & 1;
+    cpu.avx    = ymm && ((ecx >> 28) & 1) && ((ecx >> 19) & 1); // AVXFLAGS add SSE4.1
+
+    if (maxLeaf >= 7) {
+        __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+        cpu.avx2 = cpu.avx && fma && ((ebx >> 5) & 1); // AVX2FLAGS add FMA
+        cpu.bmi2 = (ebx >> 8) & 1;
+    }
+
+    cpu.fastpext = cpu.bmi2 && !(!memcmp(vendor, "AuthenticAMD", 12) && family == 0x17);
+
+    return cpu;
+}
+
+static const Configuration *selectConfiguration(const CPUFeatures *cpu) {
+
+    // ETHEREAL_ARCH may force a configuration, such as for comparing them,
+    // but never one which would fault on this processor
+    const char *forced = getenv("ETHEREAL_ARCH");
+
+    for (int i = 0; forced != NULL && i < CONFIGURATION_NB; i++) {
+        if (!strcmp(forced, Configurations[i].name)) {
+            if (Configurations[i].supported(cpu)) return &Configurations[i];
+            fprintf(stderr, "ETHEREAL_ARCH=%s is not supported by this CPU\n", forced);
+            forced = NULL;
+        }
+    }
+
+    if (forced != NULL)
+        fprintf(stderr, "ETHEREAL_ARCH=%s is not a known configuration\n", forced);
+
+    for (int i = 0; i < CONFIGURATION_NB; i++)
+        if (Configurations[i].supported(cpu))
+            return &Configurations[i];
+
+    return &Configurations[CONFIGURATION_NB - 1];
+}
+
+int main(int argc, char **argv) {
+
+    const CPUFeatures cpu = detectFeatures();
+    const Configuration *config = selectConfiguration(&cpu);
+
+    // Report the choice, and every supported alternative, when asked
+    if (argc > 1 && !strcmp(argv[1], "arch")) {
+        printf("%s\n", config->name);
+        for (int i = 0; i < CONFIGURATION_NB; i++)
+            if (&Configurations[i] != config && Configurations[i].supported(&cpu))
+                printf("  also supports %s\n", Configurations[i].name);
+        return EXIT_SUCCESS;
+    }
+
+    return config->main(argc, argv);
+}
@@ -19,10 +19,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>
-#ifdef ENABLE_MULTITHREAD
-#include <pthread.h>
-#endif
-#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,12 +48,37 @@ int LMRTable[64][64];
 int LateMovePruningCounts[2][11];
 
 #ifdef ENABLE_MULTITHREAD
-volatile int ABORT_SIGNAL; // Global ABORT flag for threads
-volatile int IS_PONDERING; // Global PONDER flag for threads
+atomic_int ABORT_SIGNAL; // Global ABORT flag for threads
+atomic_int IS_PONDERING; // Global PONDER flag for threads
 #endif
+int Deterministic = 0;   // Set by UCI options
 //volatile int ANALYSISMODE; // Whether to make some changes for Analysis
 
 
+static bool search_aborted(Thread *thread) {
+
+    /// The search is unwound cooperatively rather than by a longjmp. We poll for
+    /// the abort conditions as nodes are visited, and latch the result so that
+    /// each frame on the way back to the root sees that the search was aborted.
+    /// Results from an aborted iteration are never used, nor put into the Table
+
+    if (!thread->aborted) {
+#ifdef ENABLE_MULTITHREAD
+        // Deterministic mode only stops at the end of an epoch
+        if (thread->deterministic)
+            thread->aborted = thread->nodes % EPOCH_NODES == 0
+                           && epochSync(thread) && thread->depth > 1;
+        else
+            thread->aborted = (ABORT_SIGNAL && thread->depth > 1)
+                           || (tm_stop_early(thread) && !IS_PONDERING);
+#else
+        thread->aborted = tm_stop_early(thread);
+#endif
+    }
+
+    return thread->aborted;
+}
+
 static void select_from_threads(Thread *threads, uint16_t *best, uint16_t *ponder, int *score) {
 
     /// A thread is better than another if any are true:
@@ -215,15 +237,12 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
 
     // Updates for UCI reporting
     thread->seldepth = MAX(thread->seldepth, thread->height);
-    thread->nodes++;
+    incrementCounter(&thread->nodes);
 
-#ifdef ENABLE_MULTITHREAD
     // Step 1. Abort Check. Exit the search if signaled by main thread or the
     // UCI thread, or if the search time has expired outside pondering mode
-    if (   (ABORT_SIGNAL && thread->depth > 1)
-        || (tm_stop_early(thread) && !IS_PONDERING))
-        longjmp(thread->jbuffer, 1);
-#endif
+    if (search_aborted(thread))
+        return 0;
 
     // Step 2. Draw Detection. Check for the fifty move rule, repetition, or insufficient
     // material. Add variance to the draw score, to avoid blindness to 3-fold lines
@@ -238,13 +257,15 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
     }
 
     // Step 4. Probe the Transposition Table, adjust the value, and consider cutoffs
-    if ((ttHit = tt_probe(board->hash, thread->height, &ttMove, &ttValue, &ttEval, &ttDepth, &ttBound))) {
+    if ((ttHit = tt_probe(thread, board->hash, &ttMove, &ttValue, &ttEval, &ttDepth, &ttBound))) {
 
         // Table is exact or produces a cutoff
         if (    ttBound == BOUND_EXACT
             || (ttBound == BOUND_LOWER && ttValue >= beta)
-            || (ttBound == BOUND_UPPER && ttValue <= alpha))
+            || (ttBound == BOUND_UPPER && ttValue <= alpha)) {
+            TT_STAT(thread, cutoffs);
             return ttValue;
+        }
     }
 
     // Save a history of the static evaluations
@@ -253,7 +274,7 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
 
     // Toss the static evaluation into the TT if we won't overwrite something
     if (!ttHit && !board->kingAttackers)
-        tt_store(board->hash, thread->height, NONE_MOVE, VALUE_NONE, eval, 0, BOUND_NONE);
+        tt_store(thread, board->hash, NONE_MOVE, VALUE_NONE, eval, 0, BOUND_NONE);
 
     // Step 5. Eval Pruning. If a static evaluation of the board will
     // exceed beta, then we can stop the search here. Also, if the static
@@ -292,6 +313,9 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
         value = -qsearch(thread, &lpv, -beta, -alpha);
         revert(thread, board, move);
 
+        // Unwind without using the value, if aborted
+        if (thread->aborted) return 0;
+
         // Improved current value
         if (value > best) {
 
@@ -318,7 +342,7 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
     // Step 8. Store results of search into the Transposition Table.
     ttBound = best >= beta    ? BOUND_LOWER
             : best > oldAlpha ? BOUND_EXACT : BOUND_UPPER;
-    tt_store(board->hash, thread->height, bestMove, best, eval, 0, ttBound);
+    tt_store(thread, board->hash, bestMove, best, eval, 0, ttBound);
 
     return best;
 }
@@ -326,7 +350,9 @@ static int qsearch(Thread *thread, PVariation *pv, int alpha, int beta) {
 static int singularity(Thread *thread, uint16_t ttMove, int ttValue, int depth, int PvNode, int alpha, int beta, bool cutnode);
 static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth, bool cutnode) {
 
+#ifdef LIMITED_BY_SELF
     TimeManager *const tm = thread->tm;
+#endif
     Limits *const limits  = thread->limits;
 
     Board *const board   = &thread->board;
@@ -361,15 +387,12 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
 
     // Updates for UCI reporting
     thread->seldepth = RootNode ? 0 : MAX(thread->seldepth, thread->height);
-    thread->nodes++;
+    incrementCounter(&thread->nodes);
 
-#ifdef ENABLE_MULTITHREAD
     // Step 2. Abort Check. Exit the search if signaled by main thread or the
     // UCI thread, or if the search time has expired outside pondering mode
-    if (   (ABORT_SIGNAL && thread->depth > 1)
-        || (tm_stop_early(thread) && !IS_PONDERING))
-        longjmp(thread->jbuffer, 1);
-#endif
+    if (search_aborted(thread))
+        return 0;
 
     // Step 3. Check for early exit conditions. Don't take early exits in
     // the RootNode, since this would prevent us from having a best move
@@ -396,7 +419,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
         goto search_init_goto;
 
     // Step 4. Probe the Transposition Table, adjust the value, and consider cutoffs
-    if ((ttHit = tt_probe(board->hash, thread->height, &ttMove, &ttValue, &ttEval, &ttDepth, &ttBound))) {
+    if ((ttHit = tt_probe(thread, board->hash, &ttMove, &ttValue, &ttEval, &ttDepth, &ttBound))) {
 
         // Only cut with a greater depth search, and do not return
         // when in a PvNode, unless we would otherwise hit a qsearch
@@ -407,8 +430,10 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
             // Table is exact or produces a cutoff
             if (    ttBound == BOUND_EXACT
                 || (ttBound == BOUND_LOWER && ttValue >= beta)
-                || (ttBound == BOUND_UPPER && ttValue <= alpha))
+                || (ttBound == BOUND_UPPER && ttValue <= alpha)) {
+                TT_STAT(thread, cutoffs);
                 return ttValue;
+            }
         }
 
         // An entry coming from one depth lower than we would accept for a cutoff will
@@ -417,8 +442,10 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
             &&  ttDepth >= depth - 1
             && (ttBound & BOUND_UPPER)
             && (cutnode || ttValue <= alpha)
-            &&  ttValue + TTResearchMargin <= alpha)
+            &&  ttValue + TTResearchMargin <= alpha) {
+            TT_STAT(thread, cutoffs);
             return alpha;
+        }
     }
 
     // Step 5. Probe the Syzygy Tablebases. tablebasesProbeWDL() handles all of
@@ -426,7 +453,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
     // as well as to not probe at the Root. The return is defined by the Pyrrhic API
     if ((tbresult = tablebasesProbeWDL(board, depth, thread->height)) != TB_RESULT_FAILED) {
 
-        thread->tbhits++; // Increment tbhits counter for this thread
+        incrementCounter(&thread->tbhits); // Increment tbhits counter for this thread
 
         // Convert the WDL value to a score. We consider blessed losses
         // and cursed wins to be a draw, and thus set value to zero.
@@ -444,7 +471,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
             || (tbBound == BOUND_LOWER && value >= beta)
             || (tbBound == BOUND_UPPER && value <= alpha)) {
 
-            tt_store(board->hash, thread->height, NONE_MOVE, value, VALUE_NONE, depth, tbBound);
+            tt_store(thread, board->hash, NONE_MOVE, value, VALUE_NONE, depth, tbBound);
             return value;
         }
 
@@ -486,7 +513,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
 
     // Toss the static evaluation into the TT if we won't overwrite something
     if (!ttHit && !inCheck && !ns->excluded)
-        tt_store(board->hash, thread->height, NONE_MOVE, VALUE_NONE, eval, 0, BOUND_NONE);
+        tt_store(thread, board->hash, NONE_MOVE, VALUE_NONE, eval, 0, BOUND_NONE);
 
     // ------------------------------------------------------------------------
     // All elo estimates as of Ethereal 11.80, @ 12s+0.12 @ 1.275mnps
@@ -535,6 +562,9 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
             value = -search(thread, &lpv, -beta, -beta+1, depth-R, !cutnode);
         revert(thread, board, NULL_MOVE);
 
+        // Unwind without using the value, if aborted
+        if (thread->aborted) return 0;
+
         // Don't return unproven TB-Wins or Mates
         if (value >= beta)
             return (value > TBWIN_IN_MAX) ? beta : value;
@@ -572,9 +602,12 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
                 // Revert the board state
                 revert(thread, board, move);
 
+                // Unwind without using the value, if aborted
+                if (thread->aborted) return 0;
+
                 // Store an entry if we don't have a better one already
                 if (value >= rBeta && (!ttHit || ttDepth < depth - 3))
-                    tt_store(board->hash, thread->height, move, value, eval, depth-3, BOUND_LOWER);
+                    tt_store(thread, board->hash, move, value, eval, depth-3, BOUND_LOWER);
 
                 // Probcut failed high verifying the cutoff
                 if (value >= rBeta) return value;
@@ -585,8 +618,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
 #else
             if (
 #endif
-                (limits->limitedByDepth && thread->depth >= limits->depthLimit) ||
-                (limits->limitedByTime  && elapsed_time(tm) >= limits->timeLimit))
+                (limits->limitedByDepth && thread->depth >= limits->depthLimit))
                 break;
         }
     }
@@ -804,6 +836,9 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
         // Reset the extension tracker
         if (extension > 1) ns->dextensions--;
 
+        // Unwind without using the value, if aborted
+        if (thread->aborted) return 0;
+
 #ifdef LIMITED_BY_SELF
         // Track where nodes were spent in the Main thread at the Root
         if (RootNode && !thread->index)
@@ -835,8 +870,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
 #else
         if (
 #endif
-            (limits->limitedByDepth && thread->depth >= limits->depthLimit) ||
-            (limits->limitedByTime  && elapsed_time(tm) >= limits->timeLimit))
+            (limits->limitedByDepth && thread->depth >= limits->depthLimit))
             break;
     }
 
@@ -866,7 +900,7 @@ static int search(Thread *thread, PVariation *pv, int alpha, int beta, int depth
         ttBound  = best >= beta    ? BOUND_LOWER
                  : best > oldAlpha ? BOUND_EXACT : BOUND_UPPER;
         bestMove = ttBound == BOUND_UPPER ? NONE_MOVE : bestMove;
-        tt_store(board->hash, thread->height, bestMove, best, eval, depth, ttBound);
+        tt_store(thread, board->hash, bestMove, best, eval, depth, ttBound);
     }
 
     return best;
@@ -897,6 +931,10 @@ static void aspirationWindow(Thread *thread) {
 
         // Perform a search and consider reporting results
         pv.score = search(thread, &pv, alpha, beta, MAX(1, depth), FALSE);
+
+        // Discard the incomplete search, keeping the last completed depth
+        if (thread->aborted) return;
+
 #ifdef REPORT_DIAGNOSTICS
         if (   (report && pv.score > alpha && pv.score < beta)
             || (report && elapsed_time(thread->tm) >= WindowTimerMS))
@@ -945,24 +983,12 @@ static void* iterativeDeepening(void *vthread) {
     TimeManager *const tm = thread->tm;
     Limits *const limits  = thread->limits;
 
-#ifdef ENABLE_MULTITHREAD
-    // Bind when we expect to deal with NUMA
-    if (thread->nthreads > 8)
-        bindThisThread(thread->index);
-#endif
+    // Track the delay between "go" and this Thread's first node
+    thread->started = get_real_time();
 
     // Perform iterative deepening until exit conditions
     for (thread->depth = 1; thread->depth < MAX_PLY; thread->depth++) {
 
-#ifdef ENABLE_MULTITHREAD
-        // If we abort to here, we stop searching
-        #if defined(_WIN32) || defined(_WIN64)
-        if (_setjmp(thread->jbuffer, NULL)) break;
-        #else
-        if (setjmp(thread->jbuffer)) break;
-        #endif
-#endif
-
 #ifdef ENABLE_MULTI_PV
         // Perform a search for the current depth for each requested line of play
         for (thread->multiPV = 0; thread->multiPV < limits->multiPV; thread->multiPV++)
@@ -973,10 +999,17 @@ static void* iterativeDeepening(void *vthread) {
         thread->multiPV = 1;
 #endif
 
+        // An aborted search unwinds to here, and we stop searching
+        if (thread->aborted) break;
+
 #ifdef ENABLE_MULTITHREAD
         const int mainThread  = thread->index == 0;
-        // Helper threads need not worry about time and search info updates
-        if (!mainThread) continue;
+        // Helper threads need not worry about time and search info updates,
+        // but must respect the depth limit, since moves are not searched past it
+        if (!mainThread) {
+            if (limits->limitedByDepth && thread->depth >= limits->depthLimit) break;
+            continue;
+        }
 #endif
 
 #ifdef ENABLE_MULTI_PV
@@ -1006,22 +1039,29 @@ static void* iterativeDeepening(void *vthread) {
             break;
     }
 
+#ifdef ENABLE_MULTITHREAD
+    // Let the other Threads stop waiting on us at the end of each epoch
+    if (thread->deterministic) epochLeave(thread);
+#endif
+
     return NULL;
 }
 
 void getBestMove(Thread *threads, Board *board, Limits *limits, uint16_t *best, uint16_t *ponder, int *score) {
 
-#ifdef ENABLE_MULTITHREAD
-    pthread_t pthreads[threads->nthreads];
-#endif
     TimeManager tm = {0}; tm_init(limits, &tm);
+    tm_calibrate(board, limits, threads->nthreads, &tm);
 
-    // Minor house keeping for starting a search
+    // Minor house keeping for starting a search. ABORT_SIGNAL is clear,
+    // having been reset by the UCI thread or by the previous search
     tt_update(); // Table has an age component
+    newSearchThreadPool(threads, board, limits, &tm);
+
 #ifdef ENABLE_MULTITHREAD
-    ABORT_SIGNAL = 0; // Otherwise Threads will exit
+    // Reproducible Lazy SMP, by searching in epochs
+    if (Deterministic && threads->nthreads > 1)
+        epochBegin(threads);
 #endif
-    newSearchThreadPool(threads, board, limits, &tm);
 
     // Allow Syzygy to refine the move list for optimal results
 #ifdef ENABLE_MULTI_PV
@@ -1032,27 +1072,42 @@ void getBestMove(Thread *threads, Board *board, Limits *limits, uint16_t *best,
         tablebasesProbeDTZ(board, limits);
 
 #ifdef ENABLE_MULTITHREAD
-    // Create a new thread for each of the helpers and reuse the current
+    // Wake the pooled worker for each of the helpers and reuse the current
     // thread for the main thread, which avoids some overhead and saves
     // us from having the current thread eating CPU time while waiting
     for (int i = 1; i < threads->nthreads; i++)
-        pthread_create(&pthreads[i], NULL, &iterativeDeepening, &threads[i]);
+        startThreadJob(&threads[i], &iterativeDeepening, &threads[i]);
 #endif
+
+    // Setup covers parsing the request, up until the main thread starts
+    tm.setup_time = get_real_time() - tm.start_time;
+    double timer  = get_real_time();
+
     iterativeDeepening((void*) &threads[0]);
 
+    tm.search_time = get_real_time() - timer;
+    timer = get_real_time();
+
 #ifdef ENABLE_MULTITHREAD
     // When the main thread exits it should signal for the helpers to
-    // shutdown. Wait until all helpers have finished before moving on
-    ABORT_SIGNAL = 1;
+    // shutdown. Wait until all helpers have finished before moving on.
+    // In Deterministic mode, they stop at the end of the current epoch
+    if (!threads->deterministic) ABORT_SIGNAL = 1;
     for (int i = 1; i < threads->nthreads; i++)
-        pthread_join(pthreads[i], NULL);
+        waitThreadJob(&threads[i]);
+    ABORT_SIGNAL = 0; // Otherwise the next search will exit
 #endif
 
     // Pick the best of our completed threads
     select_from_threads(threads, best, ponder, score);
 
+    // Report covers stopping the helpers and selecting a best move
+    tm.report_time = get_real_time() - timer;
+    tm_record(&tm, threads->nthreads, nodesSearchedThreadPool(threads));
+
 #ifdef REPORT_DIAGNOSTICS
-    printf("Search time: %.0f msecs.\n", elapsed_time(&tm));
+    printf("Search time: %.0f msecs. (setup %.3f, search %.3f, report %.3f)\n",
+        elapsed_time(&tm), tm.setup_time, tm.search_time, tm.report_time);
 #endif
 }
 
@@ -16,6 +16,9 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef ENABLE_MULTITHREAD
+#include <stdatomic.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 
@@ -23,45 +26,320 @@
 #include "history.h"
 #include "search.h"
 #include "thread.h"
+#include "timeman.h"
 #include "transposition.h"
 #include "types.h"
+#include "windows.h"
+
+#include "nnue/types.h"
+#include "nnue/accumulator.h"
+#include "nnue/utils.h"
+
+#ifdef ENABLE_MULTITHREAD
+extern atomic_int ABORT_SIGNAL; // Defined by search.c
+extern atomic_int IS_PONDERING; // Defined by search.c
+
+// Barrier for the Deterministic mode. Only one search runs at a time
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int participants, arrived;
+    uint64_t round;
+    bool stop, finished;
+} Epoch = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+#endif
+
+static void resetThread(Thread *thread) {
+    memset(&thread->pktable, 0, sizeof(PKTable));
+
+    memset(&thread->killers, 0, sizeof(KillerTable));
+    memset(&thread->cmtable, 0, sizeof(CounterMoveTable));
+
+    memset(&thread->history, 0, sizeof(HistoryTable));
+    memset(&thread->chistory, 0, sizeof(CaptureHistoryTable));
+    memset(&thread->continuation, 0, sizeof(ContinuationTable));
+}
 
-// #include "nnue/types.h"
-// #include "nnue/accumulator.h"
-// #include "nnue/utils.h"
+static void initThread(Thread *threads, int index, int nthreads) {
 
-Thread* createThreadPool(int nthreads) {
+    /// Each Thread is setup by its own worker, once bound to a NUMA node when
+    /// binding is worthwhile. Linux places a page on the node which first touches
+    /// it, so every field of the Thread, small or large, is written from here
 
-    Thread *threads = calloc(nthreads, sizeof(Thread));
+    Thread *thread = &threads[index];
 
-    for (int i = 0; i < nthreads; i++) {
+#ifdef ENABLE_MULTITHREAD
+    // Bind when we expect to deal with NUMA
+    if (nthreads > 8)
+        bindThisThread(index);
+#endif
+
+    // Threads will know of each other
+    thread->index    = index;
+    thread->threads  = threads;
+    thread->nthreads = nthreads;
+
+    // Offset the Node Stack to allow looking backwards
+    thread->states = &(thread->nodeStates[STACK_OFFSET]);
+
+    // NULL out the entire continuation history
+    for (int j = 0; j < STACK_SIZE; j++)
+        thread->nodeStates[j].continuations = NULL;
+
+    // First touch of the remaining large structures
+    memset(thread->undoStack, 0, sizeof(thread->undoStack));
+    resetThread(thread);
+
+    // Accumulator stack and table require alignment
+    thread->nnue = nnue_create_evaluator();
+}
+
+#ifdef ENABLE_MULTITHREAD
+struct ThreadLaunch {
+    Thread *threads;
+    int nthreads, claimed, ready;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void *threadPoolWorker(void *vlaunch) {
+
+    /// Workers live for as long as the Thread Pool. Between jobs they park
+    /// on their condition variable, rather than being created and joined
+    /// for every search, which keeps their stacks and caches warm
+
+    struct ThreadLaunch *launch = (struct ThreadLaunch*) vlaunch;
+
+    // Claim a Thread, and set it up, including its own lock and condition
+    pthread_mutex_lock(&launch->mutex);
+    const int index = launch->claimed++;
+    pthread_mutex_unlock(&launch->mutex);
+
+    Thread *thread = &launch->threads[index];
+    initThread(launch->threads, index, launch->nthreads);
 
-        // Offset the Node Stack to allow looking backwards
-        threads[i].states = &(threads[i].nodeStates[STACK_OFFSET]);
+    thread->pthread = pthread_self();
+    pthread_mutex_init(&thread->mutex, NULL);
+    pthread_cond_init(&thread->cond, NULL);
 
-        // NULL out the entire continuation history
-        for (int j = 0; j < STACK_SIZE; j++)
-            threads[i].nodeStates[j].continuations = NULL;
+    // Report back to createThreadPool(), after which the launch is gone
+    pthread_mutex_lock(&launch->mutex);
+    if (++launch->ready == launch->nthreads)
+        pthread_cond_signal(&launch->cond);
+    pthread_mutex_unlock(&launch->mutex);
 
-        // Threads will know of each other
-        threads[i].index    = i;
-        threads[i].threads  = threads;
-        threads[i].nthreads = nthreads;
+    pthread_mutex_lock(&thread->mutex);
 
-        // Accumulator stack and table require alignment
-        //threads[i].nnue     = nnue_create_evaluator();
+    while (1) {
+
+        while (!thread->working && !thread->exiting)
+            pthread_cond_wait(&thread->cond, &thread->mutex);
+
+        if (thread->exiting) break;
+
+        // Run the job without holding on to the lock
+        pthread_mutex_unlock(&thread->mutex);
+        thread->job(thread->args);
+        pthread_mutex_lock(&thread->mutex);
+
+        // Signal anyone waiting on the job to finish
+        thread->working = FALSE;
+        pthread_cond_broadcast(&thread->cond);
+    }
+
+    pthread_mutex_unlock(&thread->mutex);
+    return NULL;
+}
+#endif
+
+Thread* createThreadPool(int nthreads) {
+
+    // Large callocs are served by fresh pages, which are
+    // not yet placed on any NUMA node until first touched.
+    // calloc() only aligns to 16 bytes, while the tables of
+    // a Thread are ALIGN64, and AVX code assumes as much. So
+    // we align by hand to a page, stashing the block in the
+    // page before, which leaves the Threads untouched by us
+    char *block = calloc(1, nthreads * sizeof(Thread) + 4096);
+    Thread *threads = (Thread*) (((uintptr_t) block + 4096) & ~(uintptr_t) 4095);
+    ((char**) threads)[-1] = block;
+
+#ifdef ENABLE_MULTITHREAD
+    // Launch the workers, each of which sets up a Thread of its own
+    struct ThreadLaunch launch = {
+        .threads = threads, .nthreads = nthreads,
+        .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER
+    };
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t pthread;
+        pthread_create(&pthread, NULL, &threadPoolWorker, &launch);
     }
 
+    pthread_mutex_lock(&launch.mutex);
+    while (launch.ready < nthreads)
+        pthread_cond_wait(&launch.cond, &launch.mutex);
+    pthread_mutex_unlock(&launch.mutex);
+
+    pthread_cond_destroy(&launch.cond);
+    pthread_mutex_destroy(&launch.mutex);
+#else
+    for (int i = 0; i < nthreads; i++)
+        initThread(threads, i, nthreads);
+#endif
+
     return threads;
 }
 
 void deleteThreadPool(Thread *threads) {
 
-    // for (int i = 0; i < threads->nthreads; i++)
-    //     nnue_delete_evaluator(threads[i].nnue);
+#ifdef ENABLE_MULTITHREAD
+    // Let any running jobs finish, before retiring the workers
+    for (int i = 0; i < threads->nthreads; i++) {
+
+        waitThreadJob(&threads[i]);
+
+        pthread_mutex_lock(&threads[i].mutex);
+        threads[i].exiting = TRUE;
+        pthread_cond_signal(&threads[i].cond);
+        pthread_mutex_unlock(&threads[i].mutex);
+
+        pthread_join(threads[i].pthread, NULL);
+        pthread_cond_destroy(&threads[i].cond);
+        pthread_mutex_destroy(&threads[i].mutex);
+    }
+#endif
+
+    for (int i = 0; i < threads->nthreads; i++)
+        nnue_delete_evaluator(threads[i].nnue);
+
+    for (int i = 0; i < threads->nthreads; i++)
+        free(threads[i].overlay);
+
+    free(((char**) threads)[-1]);
+}
+
+#ifdef ENABLE_MULTITHREAD
+void startThreadJob(Thread *thread, void *(*job)(void *), void *args) {
+
+    // Hand a job to the Thread's worker. If the worker is still busy
+    // with a previous job, we block until that job has been finished
+
+    pthread_mutex_lock(&thread->mutex);
 
-    free(threads);
+    while (thread->working)
+        pthread_cond_wait(&thread->cond, &thread->mutex);
+
+    thread->job     = job;
+    thread->args    = args;
+    thread->working = TRUE;
+
+    pthread_cond_broadcast(&thread->cond);
+    pthread_mutex_unlock(&thread->mutex);
+}
+
+void waitThreadJob(Thread *thread) {
+
+    // Block until the Thread's worker has finished its current job
+
+    pthread_mutex_lock(&thread->mutex);
+
+    while (thread->working)
+        pthread_cond_wait(&thread->cond, &thread->mutex);
+
+    pthread_mutex_unlock(&thread->mutex);
 }
+#endif
+
+#ifdef ENABLE_MULTITHREAD
+void epochBegin(Thread *threads) {
+
+    /// Deterministic mode. Threads search in epochs of EPOCH_NODES nodes, holding
+    /// their Table stores back in an Overlay. At the end of each epoch, every Thread
+    /// waits for the rest, the Overlays are published in Thread order, and only then
+    /// is the decision to stop made. What each Thread sees, and when it stops, then
+    /// depend only on node counts, so for a given number of Threads, Hash size and
+    /// node or depth limit, every run gives the same bestmove and node counts
+
+    pthread_mutex_lock(&Epoch.mutex);
+
+    Epoch.participants = threads->nthreads;
+    Epoch.arrived      = 0;
+    Epoch.stop         = FALSE;
+    Epoch.finished     = FALSE;
+
+    pthread_mutex_unlock(&Epoch.mutex);
+
+    for (int i = 0; i < threads->nthreads; i++) {
+        if (!threads[i].overlay)
+            threads[i].overlay = calloc(TT_OVERLAY_SIZE, sizeof(TTOverlayEntry));
+        threads[i].deterministic = TRUE;
+    }
+}
+
+static void epochComplete(Thread *thread) {
+
+    // Called with the lock held, by the last Thread to arrive or leave
+
+    const Limits *limits = thread->limits;
+
+    for (int i = 0; i < thread->nthreads; i++)
+        tt_publish(&thread->threads[i]);
+
+    // The node limit is on the whole pool, which is now at an epoch boundary.
+    // The hard time limit is also honored here, as tm_stop_early() would, but
+    // where an epoch ends on the clock varies, so timed searches do not repeat
+#ifdef LIMITED_BY_SELF
+    const bool timed = limits->limitedBySelf || limits->limitedByTime;
+#else
+    const bool timed = limits->limitedByTime;
+#endif
+
+    Epoch.stop =  Epoch.finished || ABORT_SIGNAL
+              || (limits->limitedByNodes && nodesSearchedThreadPool(thread->threads) >= limits->nodeLimit)
+              || (timed && !IS_PONDERING && elapsed_time(thread->tm) >= thread->tm->max_usage);
+
+    Epoch.arrived = 0;
+    Epoch.round++;
+    pthread_cond_broadcast(&Epoch.cond);
+}
+
+bool epochSync(Thread *thread) {
+
+    // Wait for every Thread still searching to reach the end of the epoch
+
+    pthread_mutex_lock(&Epoch.mutex);
+
+    const uint64_t round = Epoch.round;
+
+    if (++Epoch.arrived == Epoch.participants)
+        epochComplete(thread);
+
+    else while (Epoch.round == round)
+        pthread_cond_wait(&Epoch.cond, &Epoch.mutex);
+
+    const bool stop = Epoch.stop;
+    pthread_mutex_unlock(&Epoch.mutex);
+    return stop;
+}
+
+void epochLeave(Thread *thread) {
+
+    // A Thread has finished searching. Its Overlay is published with the
+    // rest at the end of the epoch. Once the main Thread has finished, the
+    // helpers are stopped at the end of the epoch, as opposed to at once
+
+    pthread_mutex_lock(&Epoch.mutex);
+
+    Epoch.participants--;
+    Epoch.finished |= thread->index == 0;
+
+    if (Epoch.arrived == Epoch.participants)
+        epochComplete(thread);
+
+    pthread_mutex_unlock(&Epoch.mutex);
+}
+#endif
 
 void resetThreadPool(Thread *threads) {
 
@@ -69,17 +347,60 @@ void resetThreadPool(Thread *threads) {
     // and evaluation caching. This is needed for ucinewgame
     // calls in order to ensure a deterministic behaviour
 
-    for (int i = 0; i < threads->nthreads; i++) {
-        memset(&threads[i].pktable, 0, sizeof(PKTable));
+    for (int i = 0; i < threads->nthreads; i++)
+        resetThread(&threads[i]);
+}
 
-        memset(&threads[i].killers, 0, sizeof(KillerTable));
-        memset(&threads[i].cmtable, 0, sizeof(CounterMoveTable));
+void newNetworkThreadPool(Thread *threads) {
 
-        memset(&threads[i].history, 0, sizeof(HistoryTable));
-        memset(&threads[i].chistory, 0, sizeof(CaptureHistoryTable));
-        memset(&threads[i].continuation, 0, sizeof(ContinuationTable));
-    }
+    // The Finny tables hold Accumulators computed with the weights of
+    // the old Network, so each must be rebuilt, starting from the biases
+
+    for (int i = 0; i < threads->nthreads; i++)
+        nnue_reset_evaluator(threads[i].nnue);
+}
+
+#ifdef ENABLE_MULTITHREAD
+static void *newGameThread(void *vthread) {
+
+    Thread *thread = (Thread*) vthread;
+    const int nworkers = tt_clear_workers(thread->threads);
+
+    resetThread(thread);
+
+    if (thread->index < nworkers)
+        tt_clear_section(thread->index, nworkers);
+
+    return NULL;
+}
+#endif
+
+void newGameThreadPool(Thread *threads) {
+
+    /// Handle a ucinewgame. Each worker resets the tables of its own Thread, and
+    /// a share of the workers clear the Table, while the UCI thread moves on at
+    /// once. Any later job for a worker, such as the next search, waits for the
+    /// clearing to finish, as startThreadJob() waits for the previous job
+
+#ifdef ENABLE_MULTITHREAD
+    tt_restart(); // Before the next search can update the generation
+
+    for (int i = 0; i < threads->nthreads; i++)
+        startThreadJob(&threads[i], &newGameThread, &threads[i]);
+#else
+    resetThreadPool(threads), tt_clear(threads);
+#endif
+}
+
+#ifdef ENABLE_MULTITHREAD
+void waitThreadPool(Thread *threads) {
+
+    // Block until every worker in the Thread Pool is idle
+
+    for (int i = 0; i < threads->nthreads; i++)
+        waitThreadJob(&threads[i]);
 }
+#endif
 
 uint64_t nodesSearchedThreadPool(Thread *threads) {
 
@@ -89,7 +410,7 @@ uint64_t nodesSearchedThreadPool(Thread *threads) {
     uint64_t nodes = 0ull;
 
     for (int i = 0; i < threads->nthreads; i++)
-        nodes += threads->threads[i].nodes;
+        nodes += __atomic_load_n(&threads->threads[i].nodes, __ATOMIC_RELAXED);
 
     return nodes;
 }
@@ -102,7 +423,32 @@ uint64_t tbhitsThreadPool(Thread *threads) {
     uint64_t tbhits = 0ull;
 
     for (int i = 0; i < threads->nthreads; i++)
-        tbhits += threads->threads[i].tbhits;
+        tbhits += __atomic_load_n(&threads->threads[i].tbhits, __ATOMIC_RELAXED);
 
     return tbhits;
 }
+
+void ttstatsThreadPool(Thread *threads, TTStats *stats) {
+
+    // Add the TT counters of each Thread to the running totals. The
+    // counters are only kept when the Table is built with ENABLE_TT_STATS
+
+#ifdef ENABLE_TT_STATS
+    for (int i = 0; i < threads->nthreads; i++) {
+
+        const TTStats *local = &threads->threads[i].ttstats;
+        stats->probes     += local->probes;
+        stats->hits       += local->hits;
+        stats->collisions += local->collisions;
+        stats->cutoffs    += local->cutoffs;
+        stats->stores     += local->stores;
+        stats->skipped    += local->skipped;
+        stats->sameKey    += local->sameKey;
+        stats->empty      += local->empty;
+        stats->aged       += local->aged;
+        stats->shallower  += local->shallower;
+    }
+#else
+    (void)(threads), (void)(stats);
+#endif
+}
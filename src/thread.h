@@ -18,7 +18,9 @@
 
 #pragma once
 
-#include <setjmp.h>
+#ifdef ENABLE_MULTITHREAD
+#include <pthread.h>
+#endif
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -29,11 +31,12 @@
 #include "transposition.h"
 #include "types.h"
 
-//#include "nnue/types.h"
+#include "nnue/types.h"
 
 enum {
     STACK_OFFSET = 4,
-    STACK_SIZE = MAX_PLY + STACK_OFFSET
+    STACK_SIZE = MAX_PLY + STACK_OFFSET,
+    EPOCH_NODES = 8192,
 };
 
 struct NodeState {
@@ -62,9 +65,18 @@ struct Thread {
     uint16_t bestMoves[MAX_MOVES];
 
     uint64_t nodes, tbhits;
+    uint64_t reserved; // Nodes claimed from TimeManager's node_budget
     int depth, seldepth, height, completed;
+#ifdef ENABLE_TT_STATS
+    TTStats ttstats;
+#endif
+    bool aborted;
+    double started;
 
-    void *nnue;
+    bool deterministic;       // Searching in epochs, see epochSync()
+    TTOverlayEntry *overlay;  // Stores held back until the end of an epoch
+
+    NNUEEvaluator *nnue;
 
     Undo undoStack[STACK_SIZE];
     NodeState *states, nodeStates[STACK_SIZE];
@@ -78,8 +90,16 @@ struct Thread {
 
     int index, nthreads;
     Thread *threads;
+
 #ifdef ENABLE_MULTITHREAD
-    jmp_buf jbuffer;
+    // Each Thread is backed by a long-lived worker, which
+    // sleeps on the condition variable until given a job
+    pthread_t pthread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    void *(*job)(void *);
+    void *args;
+    bool working, exiting;
 #endif
 };
 
@@ -87,28 +107,64 @@ struct Thread {
 Thread* createThreadPool(int nthreads);
 void deleteThreadPool(Thread *threads);
 
+#ifdef ENABLE_MULTITHREAD
+void startThreadJob(Thread *thread, void *(*job)(void *), void *args);
+void waitThreadJob(Thread *thread);
+#endif
+
 void resetThreadPool(Thread *threads);
+void newGameThreadPool(Thread *threads);
+void newNetworkThreadPool(Thread *threads);
+
+#ifdef ENABLE_MULTITHREAD
+void waitThreadPool(Thread *threads);
+#endif
+
+#ifdef ENABLE_MULTITHREAD
+void epochBegin(Thread *threads);
+bool epochSync(Thread *thread);
+void epochLeave(Thread *thread);
+#endif
+
+static inline void incrementCounter(uint64_t *counter) {
+    // Counters are only written by their own Thread, but may be
+    // read by the others mid-search, so the store must be atomic
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
 
 uint64_t nodesSearchedThreadPool(Thread *threads);
 uint64_t tbhitsThreadPool(Thread *threads);
+void ttstatsThreadPool(Thread *threads, TTStats *stats);
 
 static inline void newSearchThreadPool(Thread *threads, Board *board, Limits *limits, TimeManager *tm) {
     // Initialize each Thread in the Thread Pool. We need a reference
     // to the UCI seach parameters, access to the timing information,
     // somewhere to store the results of each iteration by the main, and
-    // our own copy of the board. Also, we reset the seach statistics
+    // our own copy of the board. Also, we reset the seach statistics.
+    // The Node Stack is not cleared: the entries below the root are never
+    // written, and every entry above it is written before it is read
     for (int i = 0; i < threads->nthreads; i++) {
 
-        threads[i].limits = limits;
-        threads[i].tm     = tm;
-        threads[i].height = 0;
-        threads[i].nodes  = 0ull;
-        threads[i].tbhits = 0ull;
+        threads[i].limits   = limits;
+        threads[i].tm       = tm;
+        threads[i].height   = 0;
+        threads[i].aborted  = FALSE;
+        threads[i].nodes    = 0ull;
+        threads[i].tbhits   = 0ull;
+        threads[i].reserved = 0ull;
+        threads[i].deterministic = FALSE;
+#ifdef ENABLE_TT_STATS
+        memset(&threads[i].ttstats, 0, sizeof(TTStats));
+#endif
 
-        memcpy(&threads[i].board, board, sizeof(Board));
+        boardCopy(&threads[i].board, board);
         threads[i].board.thread = &threads[i];
 
-        memset(threads[i].nodeStates, 0, sizeof(NodeState) * STACK_SIZE);
-        // nnue_reset_evaluator(threads[i].nnue);
+#if USE_NNUE
+        // The Finny table is kept, but the root Accumulator starts stale
+        threads[i].nnue->current = &threads[i].nnue->stack[0];
+        threads[i].nnue->current->accurate[WHITE] = FALSE;
+        threads[i].nnue->current->accurate[BLACK] = FALSE;
+#endif
     }
 }
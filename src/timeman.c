@@ -18,6 +18,8 @@
 /*                                                                            */
 /******************************************************************************/
 
+#include "bitboards.h"
+#include "board.h"
 #include "search.h"
 #include "thread.h"
 #include "timeman.h"
@@ -25,11 +27,35 @@
 #include "uci.h"
 
 int MoveOverhead = 300; // Set by UCI options
+int CalibratedTime = 0; // Set by UCI options
+
+// Recent nps of the whole pool, for each class of position
+static struct { double nps; int nthreads; } Calibration[3];
+
+static double coarse_clock_slack() {
+
+    // The coarse clock should trail the precise one by at most one tick, but
+    // under virtualisation it has been seen to fall behind by almost two. We
+    // leave a margin of four ticks before trusting only the precise clock
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    if (!clock_getres(CLOCK_MONOTONIC_COARSE, &ts))
+        return 4 * (1000.0 * ts.tv_sec + ts.tv_nsec / 1000000.0);
+#endif
+    return 0.0;
+}
 
 void tm_init(const Limits *limits, TimeManager *tm) {
 
+    static double slack = -1.0;
+    if (slack < 0.0) slack = coarse_clock_slack();
+
     tm->pv_stability = 0; // Clear our stability time usage heuristic
     tm->start_time = limits->start; // Save off the start time of the search
+    tm->coarse_slack = slack;
+    tm->node_budget = limits->limitedByNodes ? limits->nodeLimit : 0;
+    tm->nodes_claimed = 0;
+    tm->exhausted = FALSE;
 #ifdef LIMITED_BY_SELF
     memset(tm->nodes, 0, sizeof(uint16_t) * 0x10000); // Clear Node counters
 
@@ -61,6 +87,45 @@ void tm_init(const Limits *limits, TimeManager *tm) {
     }
 }
 
+static int position_class(const Board *board) {
+
+    // Search speed depends heavily on the amount of material left
+    const int pieces = popcount(board->colours[WHITE] | board->colours[BLACK]);
+    return pieces > 20 ? 2 : pieces > 10 ? 1 : 0;
+}
+
+void tm_calibrate(const Board *board, const Limits *limits, int nthreads, TimeManager *tm) {
+
+    /// When enabled, convert a fixed movetime into a node budget using the nps seen
+    /// in recent searches of similar positions, with the same number of threads.
+    /// Nodes are then the primary limit, and the clock is only a safety net. Until
+    /// there is a measurement for the position class, the clock is used alone
+
+    tm->position_class = position_class(board);
+
+    if (   !CalibratedTime
+        || !limits->limitedByTime
+        ||  Calibration[tm->position_class].nthreads != nthreads)
+        return;
+
+    tm->node_budget = MAX(1, Calibration[tm->position_class].nps * limits->timeLimit / 1000.0);
+}
+
+void tm_record(const TimeManager *tm, int nthreads, uint64_t nodes) {
+
+    // Very short searches are dominated by setup, and give a poor estimate
+    if (!CalibratedTime || tm->search_time < 10.0)
+        return;
+
+    const double nps = 1000.0 * nodes / tm->search_time;
+    const int class  = tm->position_class;
+
+    // Keep a moving average, restarting if the number of threads changed
+    if (Calibration[class].nthreads != nthreads)
+        Calibration[class].nps = nps, Calibration[class].nthreads = nthreads;
+    else Calibration[class].nps = 0.75 * Calibration[class].nps + 0.25 * nps;
+}
+
 #ifdef LIMITED_BY_SELF
 void tm_update(const Thread *thread, const Limits *limits, TimeManager *tm) {
 
@@ -96,16 +161,47 @@ bool tm_finished(const Thread *thread, const TimeManager *tm) {
 }
 #endif
 
-bool tm_stop_early(const Thread *thread) {
+static bool tm_claim_nodes(Thread *thread) {
+
+    /// Threads claim nodes from the shared budget in chunks, so that a budget of N
+    /// nodes means N in total for any number of threads, while the shared counter
+    /// is only touched once every NODE_CHUNK nodes. The final chunk is cut short
+
+    TimeManager *const tm = thread->tm;
+
+    if (thread->nodes < thread->reserved)
+        return TRUE;
+
+    // Threads still in their first iteration keep polling once the budget is
+    // gone, so the exhaustion is latched, and only read from then on
+    if (__atomic_load_n(&tm->exhausted, __ATOMIC_RELAXED))
+        return FALSE;
+
+    const uint64_t claimed = __atomic_fetch_add(&tm->nodes_claimed, NODE_CHUNK, __ATOMIC_RELAXED);
+
+    if (claimed >= tm->node_budget)
+        return __atomic_store_n(&tm->exhausted, TRUE, __ATOMIC_RELAXED), FALSE;
+
+    thread->reserved = thread->nodes + MIN(NODE_CHUNK, tm->node_budget - claimed);
+    return TRUE;
+}
+
+bool tm_stop_early(Thread *thread) {
 
     /// Quit early IFF we've surpassed our max time or nodes, and have
-    /// finished at least a depth 1 search to ensure we have a best move
+    /// finished at least a depth 1 search to ensure we have a best move.
+    /// The cheap coarse clock rules out most polls, before the precise
+    /// clock is read to decide if the deadline has actually been reached
 
     const Limits *limits = thread->limits;
+    const TimeManager *tm = thread->tm;
+
+    // Either a node limit, or a calibrated node budget with the clock as a safety net
+    if (tm->node_budget && !tm_claim_nodes(thread) && thread->depth > 1)
+        return TRUE;
 
     if (limits->limitedByNodes)
-        return thread->depth > 1
-            && thread->nodes >= limits->nodeLimit / thread->nthreads;
+        return FALSE;
 
     return  thread->depth > 1
         && (thread->nodes & 1023) == 1023
@@ -114,5 +210,6 @@ bool tm_stop_early(const Thread *thread) {
 #else
         && limits->limitedByTime
 #endif
+        &&  elapsed_time_coarse(thread->tm) >= thread->tm->max_usage - thread->tm->coarse_slack
         &&  elapsed_time(thread->tm) >= thread->tm->max_usage;
 }
@@ -26,31 +26,56 @@
 #if defined(_WIN32) || defined(_WIN64)
     #include <windows.h>
 #else
-    #include <sys/time.h>
+    #include <time.h>
 #endif
 
 #include "types.h"
 
+enum { NODE_CHUNK = 1024 };
+
 struct TimeManager {
     int pv_stability;
     double start_time, ideal_usage, max_usage;
+    double coarse_slack; // Worst lag of get_coarse_time()
+    double setup_time, search_time, report_time;
+    uint64_t node_budget; // Node limit, or a calibrated stand-in for the clock
+    uint64_t nodes_claimed; // Shared by all Threads, claimed in NODE_CHUNKs
+    bool exhausted; // Set once the budget is used up, to stop claiming
+    int position_class;
 #ifdef LIMITED_BY_SELF
     uint64_t nodes[0x10000];
 #endif
 };
 
 static inline double get_real_time() {
+
+    /// Milliseconds, with sub-millisecond resolution, from a monotonic clock
+    /// which is not subject to NTP or wall clock adjustments. The values are
+    /// only meaningful as differences between two calls within this process
+
 #if defined(_WIN32) || defined(_WIN64)
-    return (double)(GetTickCount());
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return 1000.0 * counter.QuadPart / frequency.QuadPart;
 #else
-    struct timeval tv;
-    double secsInMilli, usecsInMilli;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000.0 * ts.tv_sec + ts.tv_nsec / 1000000.0;
+#endif
+}
 
-    gettimeofday(&tv, NULL);
-    secsInMilli = ((double)tv.tv_sec) * 1000;
-    usecsInMilli = tv.tv_usec / 1000;
+static inline double get_coarse_time() {
 
-    return secsInMilli + usecsInMilli;
+    /// The same clock as get_real_time(), but only updated once per kernel tick,
+    /// which makes it much cheaper to read. It may lag by up to coarse_slack
+
+#if defined(CLOCK_MONOTONIC_COARSE)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return 1000.0 * ts.tv_sec + ts.tv_nsec / 1000000.0;
+#else
+    return get_real_time();
 #endif
 }
 
@@ -58,8 +83,14 @@ static inline double elapsed_time(const TimeManager *tm) {
     return get_real_time() - tm->start_time;
 }
 
+static inline double elapsed_time_coarse(const TimeManager *tm) {
+    return get_coarse_time() - tm->start_time;
+}
+
 void tm_init(const Limits *limits, TimeManager *tm);
-bool tm_stop_early(const Thread *thread);
+void tm_calibrate(const Board *board, const Limits *limits, int nthreads, TimeManager *tm);
+void tm_record(const TimeManager *tm, int nthreads, uint64_t nodes);
+bool tm_stop_early(Thread *thread);
 
 #ifdef LIMITED_BY_SELF
 void tm_update(const Thread *thread, const Limits *limits, TimeManager *tm);
@@ -18,8 +18,16 @@
 /*                                                                            */
 /******************************************************************************/
 
-#ifdef ENABLE_MULTITHREAD
-#include <pthread.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
 #endif
 
 #include "board.h"
@@ -27,6 +35,7 @@
 #include "thread.h"
 #include "transposition.h"
 #include "types.h"
+#include "windows.h"
 #include "zobrist.h"
 
 TTable Table; // Global Transposition Table
@@ -48,59 +57,561 @@ static inline int tt_value_to(int value, int height) {
 }
 
 
+/// Each Entry is packed into a single 64-bit word, which is read and written
+/// atomically. The key of a slot is the upper 16 bits of the Zobrist Hash XORed
+/// with a fold of that word, so a key that does not belong to its data fails to
+/// verify. An empty slot, with all zero data, is never a valid Entry.
+
+static inline uint64_t tt_pack(TTEntry entry) {
+    uint64_t data; memcpy(&data, &entry, sizeof(data)); return data;
+}
+
+static inline TTEntry tt_unpack(uint64_t data) {
+    TTEntry entry; memcpy(&entry, &data, sizeof(entry)); return entry;
+}
+
+static inline uint16_t tt_fold(uint64_t data) {
+    return (uint16_t) (data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
+}
+
+static inline void tt_read(TTBucket *bucket, int slot, uint16_t *key, uint64_t *data) {
+    *data = __atomic_load_n(&bucket->data[slot], __ATOMIC_RELAXED);
+    *key  = __atomic_load_n(&bucket->keys[slot], __ATOMIC_RELAXED) ^ tt_fold(*data);
+}
+
+static inline void tt_write(TTBucket *bucket, int slot, uint16_t hash16, uint64_t data) {
+    __atomic_store_n(&bucket->data[slot], data, __ATOMIC_RELAXED);
+    __atomic_store_n(&bucket->keys[slot], hash16 ^ tt_fold(data), __ATOMIC_RELAXED);
+}
+
+#ifdef ENABLE_TT_STATS
+static inline uint64_t *tt_shadow(uint64_t hash, int slot) {
+    return &Table.shadow[(hash & Table.hashMask) * TT_BUCKET_NB + slot];
+}
+#endif
+
+static void tt_reset_shadow() {
+#ifdef ENABLE_TT_STATS
+    free(Table.shadow);
+    Table.shadow = calloc((Table.hashMask + 1) * TT_BUCKET_NB, sizeof(uint64_t));
+#endif
+}
+
+
 /// Trivial helper functions to Transposition Table handleing
 
-void tt_update() { Table.generation += TT_MASK_BOUND + 1; }
+void tt_update() {
+
+    // Mapped Tables keep the generation in their header, which may be shared
+    // with other processes, so that all of their searches age the Table alike
+    if (Table.header)
+        Table.generation = __atomic_add_fetch(&Table.header->generation, TT_MASK_BOUND + 1, __ATOMIC_RELAXED);
+    else Table.generation += TT_MASK_BOUND + 1;
+}
+
+void tt_restart() {
+
+    // A cleared Table restarts its aging, so that searches from a cleared
+    // Table repeat exactly. Shared Tables are never cleared, and keep aging
+    if (Table.shmname[0]) return;
+
+    Table.generation = 0;
+    if (Table.header) __atomic_store_n(&Table.header->generation, 0, __ATOMIC_RELAXED);
+}
+
 void tt_prefetch(uint64_t hash) { __builtin_prefetch(&Table.buckets[hash & Table.hashMask]); }
+int tt_megabytes() { return (int) (((Table.hashMask + 1) * sizeof(TTBucket)) >> 20); }
 
 
-int tt_init(int nthreads, int megabytes) {
-    // Cleanup memory when resizing the table
-    if (Table.hashMask)
-        free(Table.buckets);
+/// Tables may live on the heap, or be mapped from a file. Files carry a header
+/// which must match the build exactly, and in the case of the Bucket count, must
+/// match the size of the file, before we will accept their contents
 
-#ifdef ENABLE_MULTITHREAD
-    const uint64_t MB = 1ull << 20;
-    uint64_t keySize = 16ull;
+static TTHeader tt_header() {
 
-    // Default keysize of 16 bits maps to a 2MB TTable
-    assert((1ull << 16ull) * sizeof(TTBucket) == 2 * MB);
+    TTHeader header = {
+        .magic         = "ETHTT",
+        .version       = TT_FILE_VERSION,
+        .bucketSize    = sizeof(TTBucket),
+        .bucketEntries = TT_BUCKET_NB,
+        .generation    = Table.generation,
+        .buckets       = Table.hashMask + 1,
+    };
 
-    // Find the largest keysize that is still within our given megabytes
-    while ((1ull << keySize) * sizeof(TTBucket) <= megabytes * MB / 2) keySize++;
-    assert((1ull << keySize) * sizeof(TTBucket) <= megabytes * MB);
+    return header;
+}
+
+static bool tt_header_valid(const TTHeader *header, uint64_t bytes) {
+
+    const TTHeader expected = tt_header();
+
+    return !memcmp(header->magic, expected.magic, sizeof(header->magic))
+        && header->version       == expected.version
+        && header->bucketSize    == expected.bucketSize
+        && header->bucketEntries == expected.bucketEntries
+        && header->buckets       >= (1ull << TT_KEYSIZE_MIN)
+        && !(header->buckets & (header->buckets - 1))
+        && bytes == TT_HEADER_SIZE + header->buckets * sizeof(TTBucket);
+}
+
+static void tt_stamp(TTHeader *header) {
+
+    // Write the version last, so that another process attaching to a shared
+    // Table never sees a valid header before all of the fields are in place
+    TTHeader contents = tt_header();
+    contents.version  = 0;
+    contents.attached = header->attached;
+    contents.creator  = header->creator;
+    *header = contents;
+
+    __atomic_store_n(&header->version, TT_FILE_VERSION, __ATOMIC_RELEASE);
+}
+
+#ifndef _WIN32
+static bool tt_header_creating(const TTHeader *header) {
+
+    // A shared segment is marked by its creator until the Table is ready,
+    // which only means anything for as long as the creator is still alive
+
+    const TTHeader expected = tt_header();
+
+    return !memcmp(header->magic, expected.magic, sizeof(header->magic))
+        && header->version == 0
+        && header->creator  > 0
+        && (!kill(header->creator, 0) || errno == EPERM);
+}
+#endif
+
+static TTBucket *tt_alloc(uint64_t buckets) {
+
+    const uint64_t MB = 1ull << 20;
 
 #if defined(__linux__) && !defined(__ANDROID__)
 
     // On Linux systems we align on 2MB boundaries and request Huge Pages
-    Table.buckets = aligned_alloc(2 * MB, (1ull << keySize) * sizeof(TTBucket));
-    madvise(Table.buckets, (1ull << keySize) * sizeof(TTBucket), MADV_HUGEPAGE);
+    TTBucket *memory = aligned_alloc(2 * MB, buckets * sizeof(TTBucket));
+    madvise(memory, buckets * sizeof(TTBucket), MADV_HUGEPAGE);
+
+    // Optionally spread the Table over all NUMA nodes, before any first touch
+    if (Table.interleave) interleaveMemory(memory, buckets * sizeof(TTBucket));
+    return memory;
 #else
 
     // Otherwise, we simply allocate as usual and make no requests
-    Table.buckets = malloc((1ull << keySize) * sizeof(TTBucket));
+    (void)(MB);
+    return malloc(buckets * sizeof(TTBucket));
+#endif
+}
+
+static void tt_release(TTable *table) {
+
+    const uint64_t size = (table->hashMask + 1) * sizeof(TTBucket);
+
+    if (!table->hashMask) return;
+
+#ifndef _WIN32
+
+    // The last process to detach from a shared segment removes its name, so
+    // that the memory is returned once the segment is no longer mapped
+    if (   table->segment[0]
+        && !__atomic_sub_fetch(&table->header->attached, 1, __ATOMIC_ACQ_REL))
+        shm_unlink(table->segment);
+
+    if (table->header) munmap(table->header, TT_HEADER_SIZE + size);
+    else free(table->buckets);
+#else
+    (void)(size);
+    free(table->buckets);
+#endif
+
+    table->buckets = NULL, table->header = NULL, table->hashMask = 0;
+    table->segment[0] = '\0';
+}
+
+static TTHeader *tt_map_file(const char *path, uint64_t buckets, bool *reused) {
+
+#ifndef _WIN32
+
+    /// Map the file at the given path as the backing storage for the Table, with
+    /// changes written through to the file. A file which already contains a valid
+    /// Table of the same size is kept as is, otherwise the file is wiped to zeros
+
+    TTHeader header;
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    const uint64_t bytes = TT_HEADER_SIZE + buckets * sizeof(TTBucket);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+
+    *reused = !fstat(fd, &st)
+           && (uint64_t) st.st_size == bytes
+           && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+           && tt_header_valid(&header, bytes);
+
+    if (*reused || (!ftruncate(fd, 0) && !ftruncate(fd, bytes)))
+        mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+    return mapping == MAP_FAILED ? NULL : (TTHeader*) mapping;
+
+#else
+    (void)(path), (void)(buckets), (void)(reused);
+    return NULL;
+#endif
+}
+
+static TTHeader *tt_map_shared(const char *name, uint64_t *buckets, bool *reused) {
+
+#ifndef _WIN32
+
+    /// Map the named POSIX shared memory segment as the backing storage for the
+    /// Table. The first process creates the segment with the requested size, while
+    /// any later process attaches to it as is, and adopts the size of the segment
+
+    TTHeader header;
+    struct stat st;
+    void *mapping = MAP_FAILED;
+    uint64_t bytes = TT_HEADER_SIZE + *buckets * sizeof(TTBucket);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    // Attach to an existing segment. Clearing a large Table takes a while, so we
+    // wait for as long as the creator is alive and marks the segment as still
+    // being created. Otherwise we give up after a second without a valid header
+    if ((*reused = fd < 0 && errno == EEXIST)) {
+
+        fd = shm_open(name, O_RDWR, 0600);
+
+        for (int waited = 0; fd >= 0 && waited < 1000; usleep(1000)) {
+
+            const bool readable = !fstat(fd, &st)
+                && (uint64_t) st.st_size >= TT_HEADER_SIZE
+                && pread(fd, &header, sizeof(header), 0) == sizeof(header);
+
+            if (readable && tt_header_valid(&header, (bytes = st.st_size)))
+                break;
+
+            bytes = 0;
+            waited += !readable || !tt_header_creating(&header);
+        }
+    }
+
+    if (fd < 0) return NULL;
+
+    if (*reused && bytes)
+        *buckets = (bytes - TT_HEADER_SIZE) / sizeof(TTBucket);
+
+    else if (!*reused && ftruncate(fd, bytes))
+        shm_unlink(name), bytes = 0;
+
+    if (bytes)
+        mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (mapping == MAP_FAILED) {
+        if (!*reused && bytes) shm_unlink(name);
+        return NULL;
+    }
+
+    // Mark a new segment as being created, until tt_stamp() finds it ready
+    if (!*reused) {
+        memcpy(((TTHeader*) mapping)->magic, tt_header().magic, sizeof(header.magic));
+        __atomic_store_n(&((TTHeader*) mapping)->creator, (int32_t) getpid(), __ATOMIC_RELEASE);
+    }
+
+    // Count ourselves in, unless the last process just detached and removed
+    // the name, in which case the segment is on its way out and is not used
+    uint32_t attached = __atomic_load_n(&((TTHeader*) mapping)->attached, __ATOMIC_ACQUIRE);
+
+    while (   (attached || !*reused)
+           && !__atomic_compare_exchange_n(&((TTHeader*) mapping)->attached, &attached,
+                attached + 1, FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (*reused && !attached)
+        return munmap(mapping, bytes), NULL;
+
+    return (TTHeader*) mapping;
+
+#else
+    (void)(name), (void)(buckets), (void)(reused);
+    return NULL;
 #endif
+}
+
+
+static void *tt_rehash_threaded(void *cargo) {
+
+    /// Move the Entries of the old Table into a slice of the new one. The Bucket of
+    /// an Entry is given by the lower bits of its Zobrist Hash, while its key only
+    /// depends on the upper bits, so Entries may be moved without being re-keyed
+
+    struct TTRehash *rehash = (struct TTRehash*) cargo;
+    const TTable *source = rehash->source;
+
+    const uint64_t size  = rehash->hashMask + 1;
+    const uint64_t begin = size * rehash->index / rehash->count;
+    const uint64_t end   = size * (rehash->index + 1) / rehash->count;
+
+    for (uint64_t i = begin; i < end; i++) {
+
+        TTBucket *bucket = &rehash->buckets[i];
+        int scores[TT_BUCKET_NB], used = 0;
+
+        // When growing, we no longer know which of the Buckets sharing the lower
+        // bits an Entry belongs to, so each of those Buckets inherits a copy
+        if (rehash->hashMask >= source->hashMask) {
+            *bucket = source->buckets[i & source->hashMask];
+            continue;
+        }
+
+        // When shrinking, many old Buckets fold into each new one, and we keep
+        // the Entries which the replacement scheme would value the most
+        memset(bucket, 0, sizeof(TTBucket));
+
+        for (uint64_t j = i; j <= source->hashMask; j += size) {
+            for (int k = 0; k < TT_BUCKET_NB; k++) {
+
+                const uint64_t data = source->buckets[j].data[k];
+                const TTEntry entry = tt_unpack(data);
+                const int score = entry.depth - ((259 + source->generation - entry.generation) & TT_MASK_AGE);
+                int slot = used;
+
+                if (!data) continue;
+
+                // Once full, take the place of the least valuable Entry
+                if (used == TT_BUCKET_NB) {
+                    for (int l = slot = 0; l < TT_BUCKET_NB; l++)
+                        if (scores[l] < scores[slot]) slot = l;
+                    if (scores[slot] >= score) continue;
+                }
+
+                else used++;
+
+                scores[slot]       = score;
+                bucket->keys[slot] = source->buckets[j].keys[k];
+                bucket->data[slot] = data;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void tt_rehash(Thread *threads, TTBucket *buckets, uint64_t hashMask, const TTable *source) {
+
+#ifdef ENABLE_MULTITHREAD
+    // Use every Thread, as the rehash is bound by memory bandwidth
+    int nworkers = threads->nthreads;
+#else
+    (void)(threads);
+    int nworkers = 1;
+#endif
+
+    struct TTRehash rehashes[nworkers];
+
+    // Initalize the data passed via a void* to each worker
+    for (int i = 0; i < nworkers; i++)
+        rehashes[i] = (struct TTRehash) { buckets, hashMask, source, i, nworkers };
+
+#ifdef ENABLE_MULTITHREAD
+    // Hand each of the pooled helper threads their sections
+    for (int i = 1; i < nworkers; i++)
+        startThreadJob(&threads[i], tt_rehash_threaded, &rehashes[i]);
+#endif
+
+    // Reuse this thread for the 0th section of the new Table
+    tt_rehash_threaded((void*) &rehashes[0]);
+
+#ifdef ENABLE_MULTITHREAD
+    // Wait for each of the helper threads to rehash their sections
+    for (int i = 1; i < nworkers; i++)
+        waitThreadJob(&threads[i]);
+#endif
+}
+
+
+int tt_init(Thread *threads, int megabytes) {
+
+    const uint64_t MB = 1ull << 20;
+    uint64_t keySize = TT_KEYSIZE_MIN;
+    bool reused = FALSE;
+
+    // Hold on to the old Table, so that its contents can be rehashed
+    TTable old = Table;
+    Table.buckets = NULL, Table.header = NULL, Table.hashMask = 0, Table.segment[0] = '\0';
+
+    // Default keysize of 16 bits (or 15 bits for 64-byte Buckets) maps to a 2MB TTable
+    assert((1ull << TT_KEYSIZE_MIN) * sizeof(TTBucket) == 2 * MB);
+
+    // Find the largest keysize that is still within our given megabytes
+    while ((1ull << keySize) * sizeof(TTBucket) <= megabytes * MB / 2) keySize++;
+    assert((1ull << keySize) * sizeof(TTBucket) <= MAX(2, megabytes) * MB);
+
+    uint64_t buckets = 1ull << keySize;
+
+    // Remapping a file may truncate it from under the old Table,
+    // so the old Table is first rehashed into a copy on the heap
+    if (Table.path[0] && old.hashMask) {
+        TTBucket *copy = tt_alloc(buckets);
+        tt_rehash(threads, copy, buckets - 1, &old);
+        tt_release(&old);
+        old.buckets = copy, old.hashMask = buckets - 1;
+    }
+
+    // Back the Table with shared memory or a file when requested
+    if (Table.shmname[0])
+        Table.header = tt_map_shared(Table.shmname, &buckets, &reused);
+
+    else if (Table.path[0])
+        Table.header = tt_map_file(Table.path, buckets, &reused);
+
+    if (Table.header && Table.shmname[0])
+        snprintf(Table.segment, sizeof(Table.segment), "%s", Table.shmname);
+
+    if (Table.header)
+        Table.buckets = (TTBucket*) ((char*) Table.header + TT_HEADER_SIZE);
+
+    // Otherwise, or if that failed, fall back to an empty Table on the heap
+    else {
+        Table.path[0] = Table.shmname[0] = '\0';
+        Table.buckets = tt_alloc(buckets);
+        reused = FALSE;
+    }
 
     // Save the lookup mask
-    Table.hashMask = (1ull << keySize) - 1u;
+    Table.hashMask = buckets - 1u;
+
+    // Continue with the contents of a compatible file or segment, otherwise
+    // carry over the old Table, or clear the table and load everything into the cache
+    if (reused) Table.generation = __atomic_load_n(&Table.header->generation, __ATOMIC_RELAXED);
+    else if (old.hashMask) tt_rehash(threads, Table.buckets, Table.hashMask, &old);
+    else tt_clear(threads);
+
+    // Cleanup the memory of the old table
+    tt_release(&old);
+    tt_reset_shadow();
+
+    // Stamp the header of a mapped Table with our layout
+    if (Table.header && !reused) tt_stamp(Table.header);
+
+    // Return the number of MB actually allocated for the TTable
+    return tt_megabytes();
+}
+
+void tt_free() {
+
+    /// Release the Table, detaching from any shared memory segment, so that the
+    /// segment is removed when the last of the processes using it exits cleanly
+
+    tt_release(&Table);
+    tt_reset_shadow();
+}
+
+bool tt_save(const char *path) {
+
+    /// Write the Table to disk, behind a page-sized header, so that
+    /// the file can be later mapped directly back in by tt_load()
+
+    char header[TT_HEADER_SIZE] = {0};
+    const TTHeader contents = tt_header();
+    const uint64_t buckets = Table.hashMask + 1;
+
+    FILE *fout = fopen(path, "wb");
+    if (fout == NULL) return FALSE;
+
+    memcpy(header, &contents, sizeof(contents));
+
+    bool okay = fwrite(header, TT_HEADER_SIZE, 1, fout) == 1
+             && fwrite(Table.buckets, sizeof(TTBucket), buckets, fout) == buckets;
 
-    // Clear the table and load everything into the cache
-    tt_clear(nthreads);
+    return !fclose(fout) && okay;
+}
+
+bool tt_load(const char *path) {
+
+    /// Replace the Table with one saved by tt_save(). Where possible, the file
+    /// is mapped privately, so pages are only read from the file as they are
+    /// touched, and are only copied if we write to them during a search
+
+    TTHeader header;
+    FILE *fin = fopen(path, "rb");
+    if (fin == NULL) return FALSE;
+
+    fseek(fin, 0, SEEK_END);
+    const uint64_t bytes = ftell(fin);
+    fseek(fin, 0, SEEK_SET);
+
+    if (   fread(&header, sizeof(header), 1, fin) != 1
+        || !tt_header_valid(&header, bytes))
+        return fclose(fin), FALSE;
+
+#ifndef _WIN32
+
+    void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(fin), 0);
+    fclose(fin);
+
+    if (mapping == MAP_FAILED)
+        return FALSE;
+
+    tt_release(&Table);
+    Table.header  = (TTHeader*) mapping;
+    Table.buckets = (TTBucket*) ((char*) mapping + TT_HEADER_SIZE);
 
-    int bytes = ((Table.hashMask + 1) * sizeof(TTBucket));
-    return bytes / MB;
 #else
-    (void)(nthreads), (void)(megabytes);
 
-    uint64_t size = 512;
-    int bytes = (int)(size * sizeof(TTBucket));
+    TTBucket *buckets = malloc(header.buckets * sizeof(TTBucket));
 
-    Table.hashMask = size - 1;
-    Table.buckets = malloc(bytes);
-    memset(Table.buckets, 0, bytes);
+    fseek(fin, TT_HEADER_SIZE, SEEK_SET);
+    if (fread(buckets, sizeof(TTBucket), header.buckets, fin) != header.buckets)
+        return free(buckets), fclose(fin), FALSE;
+
+    fclose(fin);
+    tt_release(&Table);
+    Table.buckets = buckets;
 
-    return bytes;
 #endif
+
+    Table.path[0]    = Table.shmname[0] = '\0';
+    Table.hashMask   = header.buckets - 1;
+    Table.generation = header.generation;
+
+    tt_reset_shadow();
+    return TRUE;
+}
+
+bool tt_set_file(Thread *threads, const char *path) {
+
+    /// Back the Table with the given file, or with the heap when given
+    /// an empty path, keeping the current size of the Table
+
+    Table.shmname[0] = '\0';
+    snprintf(Table.path, sizeof(Table.path), "%s", path);
+    tt_init(threads, tt_megabytes());
+
+    return !path[0] || Table.path[0];
+}
+
+void tt_set_interleave(Thread *threads, bool interleave) {
+
+    /// Reallocate the Table with, or without, pages interleaved across NUMA
+    /// nodes. Otherwise pages land on the nodes of the Threads clearing them
+
+    Table.interleave = interleave;
+    tt_init(threads, tt_megabytes());
+}
+
+bool tt_set_shared(Thread *threads, const char *name) {
+
+    /// Back the Table with the named shared memory segment, or with the heap
+    /// when given an empty name. POSIX names begin with a single slash
+
+    Table.path[0] = '\0';
+    snprintf(Table.shmname, sizeof(Table.shmname), "%s%s", name[0] == '/' || !name[0] ? "" : "/", name);
+    tt_init(threads, tt_megabytes());
+
+    return !name[0] || Table.shmname[0];
 }
 
 int tt_hashfull() {
@@ -110,35 +621,73 @@ int tt_hashfull() {
 
     int used = 0;
 
-    int size = Table.hashMask + 1;
-    for (int i = 0; i < size; i++)
-        for (int j = 0; j < TT_BUCKET_NB; j++)
-            used += (Table.buckets[i].slots[j].generation & TT_MASK_BOUND) != BOUND_NONE
-                 && (Table.buckets[i].slots[j].generation & TT_MASK_AGE) == Table.generation;
+    // The smallest Table holds 32768 Buckets, so the sample always fits
+    for (int i = 0; i < 1000; i++) {
+        for (int j = 0; j < TT_BUCKET_NB; j++) {
+            TTEntry entry = tt_unpack(__atomic_load_n(&Table.buckets[i].data[j], __ATOMIC_RELAXED));
+            used += (entry.generation & TT_MASK_BOUND) != BOUND_NONE
+                 && (entry.generation & TT_MASK_AGE) == Table.generation;
+        }
+    }
 
     return used / TT_BUCKET_NB;
 }
 
-bool tt_probe(uint64_t hash, int height, uint16_t *move, int *value, int *eval, int *depth, int *bound) {
+bool tt_probe(Thread *thread, uint64_t hash, uint16_t *move, int *value, int *eval, int *depth, int *bound) {
 
     /// Search for a Transposition matching the provided Zobrist Hash. If one is found,
     /// we update its age in order to indicate that it is still relevant, before copying
     /// over its contents and signaling to the caller that an Entry was found.
 
+    uint16_t key; uint64_t data;
     const uint16_t hash16 = hash >> 48;
-    TTEntry *slots = Table.buckets[hash & Table.hashMask].slots;
+    TTBucket *bucket = &Table.buckets[hash & Table.hashMask];
+
+    TT_STAT(thread, probes);
+
+    // Deterministic mode: our own unpublished stores come first
+    if (thread->deterministic) {
+
+        const TTOverlayEntry *slot = &thread->overlay[hash & (TT_OVERLAY_SIZE - 1)];
+
+        if (slot->hash == hash) {
+            TT_STAT(thread, hits);
+            *move  = slot->entry.move;
+            *value = tt_value_from(slot->entry.value, thread->height);
+            *eval  = slot->entry.eval;
+            *depth = slot->entry.depth;
+            *bound = slot->entry.generation & TT_MASK_BOUND;
+            return TRUE;
+        }
+    }
 
     for (int i = 0; i < TT_BUCKET_NB; i++) {
 
-        if (slots[i].hash16 == hash16) {
+        tt_read(bucket, i, &key, &data);
 
-            slots[i].generation = Table.generation | (slots[i].generation & TT_MASK_BOUND);
+        if (key == hash16 && data) {
+
+            TTEntry entry = tt_unpack(data);
+
+            TT_STAT(thread, hits);
+
+#ifdef ENABLE_TT_STATS
+            // Shadows are unknown (zero) for Entries from a rehash or another process
+            const uint64_t shadow = __atomic_load_n(tt_shadow(hash, i), __ATOMIC_RELAXED);
+            if (shadow && shadow != hash) TT_STAT(thread, collisions);
+#endif
 
-            *move  = slots[i].move;
-            *value = tt_value_from(slots[i].value, height);
-            *eval  = slots[i].eval;
-            *depth = slots[i].depth;
-            *bound = slots[i].generation & TT_MASK_BOUND;
+            // Refreshing the age is a store, so it waits for the epoch in Deterministic mode
+            if ((entry.generation & TT_MASK_AGE) != Table.generation && !thread->deterministic) {
+                entry.generation = Table.generation | (entry.generation & TT_MASK_BOUND);
+                tt_write(bucket, i, hash16, tt_pack(entry));
+            }
+
+            *move  = entry.move;
+            *value = tt_value_from(entry.value, thread->height);
+            *eval  = entry.eval;
+            *depth = entry.depth;
+            *bound = entry.generation & TT_MASK_BOUND;
             return TRUE;
         }
     }
@@ -146,40 +695,134 @@ bool tt_probe(uint64_t hash, int height, uint16_t *move, int *value, int *eval,
     return FALSE;
 }
 
-void tt_store(uint64_t hash, int height, uint16_t move, int value, int eval, int depth, int bound) {
+static void tt_store_entry(Thread *thread, uint64_t hash, TTEntry entry) {
 
-    int i;
+    int i, replace = 0;
+    const int depth = entry.depth, bound = entry.generation & TT_MASK_BOUND;
     const uint16_t hash16 = hash >> 48;
-    TTEntry *slots = Table.buckets[hash & Table.hashMask].slots;
-    TTEntry *replace = slots; // &slots[0]
+    TTBucket *bucket = &Table.buckets[hash & Table.hashMask];
+
+    uint16_t keys[TT_BUCKET_NB];
+    TTEntry slots[TT_BUCKET_NB];
+
+    // Take a private, verified copy of each slot in the Bucket
+    for (i = 0; i < TT_BUCKET_NB; i++) {
+        uint64_t data; tt_read(bucket, i, &keys[i], &data);
+        slots[i] = tt_unpack(data);
+        if (!data) keys[i] = ~hash16;
+    }
 
     // Find a matching hash, or replace using MIN(x1, x2, x3),
     // where xN equals the depth minus 4 times the age difference
-    for (i = 0; i < TT_BUCKET_NB && slots[i].hash16 != hash16; i++)
-        if (   replace->depth - ((259 + Table.generation - replace->generation) & TT_MASK_AGE)
-            >= slots[i].depth - ((259 + Table.generation - slots[i].generation) & TT_MASK_AGE))
-            replace = &slots[i];
+    for (i = 0; i < TT_BUCKET_NB && keys[i] != hash16; i++)
+        if (   slots[replace].depth - ((259 + Table.generation - slots[replace].generation) & TT_MASK_AGE)
+            >= slots[i].depth       - ((259 + Table.generation - slots[i].generation      ) & TT_MASK_AGE))
+            replace = i;
 
     // Prefer a matching hash, otherwise score a replacement
-    replace = (i != TT_BUCKET_NB) ? &slots[i] : replace;
+    replace = (i != TT_BUCKET_NB) ? i : replace;
 
     // Don't overwrite an entry from the same position, unless we have
     // an exact bound or depth that is nearly as good as the old one
     if (   bound != BOUND_EXACT
-        && hash16 == replace->hash16
-        && depth < replace->depth - 2)
+        && hash16 == keys[replace]
+        && depth < slots[replace].depth - 2) {
+        TT_STAT(thread, skipped);
         return;
+    }
+
+#ifdef ENABLE_TT_STATS
+    // Classify the replacement, before the slot is overwritten
+    if      (hash16 == keys[replace])                                       TT_STAT(thread, sameKey);
+    else if (!tt_pack(slots[replace]))                                      TT_STAT(thread, empty);
+    else if ((slots[replace].generation & TT_MASK_AGE) != Table.generation) TT_STAT(thread, aged);
+    else                                                                    TT_STAT(thread, shallower);
+
+    TT_STAT(thread, stores);
+    __atomic_store_n(tt_shadow(hash, replace), hash, __ATOMIC_RELAXED);
+#endif
 
     // Don't overwrite a move if we don't have a new one
-    if (move || hash16 != replace->hash16)
-        replace->move = (uint16_t) move;
+    if (!entry.move && hash16 == keys[replace])
+        entry.move = slots[replace].move;
 
     // Finally, copy the new data into the replaced slot
-    replace->depth      = (int8_t  ) depth;
-    replace->generation = (uint8_t ) bound | Table.generation;
-    replace->value      = (int16_t ) tt_value_to(value, height);
-    replace->eval       = (int16_t ) eval;
-    replace->hash16     = (uint16_t) hash16;
+    tt_write(bucket, replace, hash16, tt_pack(entry));
+}
+
+void tt_store(Thread *thread, uint64_t hash, uint16_t move, int value, int eval, int depth, int bound) {
+
+    TTEntry entry = {
+        .move       = (uint16_t) move,
+        .value      = (int16_t ) tt_value_to(value, thread->height),
+        .eval       = (int16_t ) eval,
+        .depth      = (int8_t  ) depth,
+        .generation = (uint8_t ) bound | Table.generation,
+    };
+
+    if (!thread->deterministic) {
+        tt_store_entry(thread, hash, entry);
+        return;
+    }
+
+    // Deterministic mode: hold the store until the end of the epoch,
+    // using the same rules as the Table for a repeated position
+    TTOverlayEntry *slot = &thread->overlay[hash & (TT_OVERLAY_SIZE - 1)];
+
+    if (slot->hash == hash) {
+
+        if (bound != BOUND_EXACT && depth < slot->entry.depth - 2)
+            return;
+
+        if (!move) entry.move = slot->entry.move;
+    }
+
+    slot->hash = hash, slot->entry = entry;
+}
+
+void tt_publish(Thread *thread) {
+
+    /// Move the stores held in a Thread's Overlay into the Table. Each Overlay is
+    /// walked in a fixed order, and the Threads are published in a fixed order by
+    /// epochSync(), so the resulting Table depends only on what was searched
+
+    for (int i = 0; i < TT_OVERLAY_SIZE; i++)
+        if (thread->overlay[i].hash)
+            tt_store_entry(thread, thread->overlay[i].hash, thread->overlay[i].entry);
+
+    memset(thread->overlay, 0, sizeof(TTOverlayEntry) * TT_OVERLAY_SIZE);
+}
+
+void tt_print_stats(const TTStats *stats) {
+
+    /// Summarize the counters collected by the Threads. The hit rate and the
+    /// share of hits which were collisions speak to the size of the Table, as
+    /// does the share of stores which had to replace an Entry from this search
+
+#ifdef ENABLE_TT_STATS
+
+    const double probes = MAX(1ull, stats->probes);
+    const double hits   = MAX(1ull, stats->hits);
+    const double stores = MAX(1ull, stats->stores);
+
+    printf("TT Probes   %14"PRIu64"   Hits %12"PRIu64" %7.2f %%\n",
+        stats->probes, stats->hits, 100.0 * stats->hits / probes);
+    printf("TT Hits     %14"PRIu64"   Cutoffs %9"PRIu64" %7.2f %%   Collisions %6"PRIu64" %7.4f %%\n",
+        stats->hits, stats->cutoffs, 100.0 * stats->cutoffs / hits, stats->collisions, 100.0 * stats->collisions / hits);
+    printf("TT Stores   %14"PRIu64"   Skipped %9"PRIu64"   Same %12"PRIu64" %7.2f %%\n",
+        stats->stores, stats->skipped, stats->sameKey, 100.0 * stats->sameKey / stores);
+    printf("TT Replaced %14"PRIu64"   Empty %11"PRIu64" %7.2f %%   Aged %12"PRIu64" %7.2f %%   Shallower %12"PRIu64" %7.2f %%\n",
+        stats->empty + stats->aged + stats->shallower,
+        stats->empty, 100.0 * stats->empty / stores,
+        stats->aged, 100.0 * stats->aged / stores,
+        stats->shallower, 100.0 * stats->shallower / stores);
+#else
+    (void)(stats);
+    printf("TT Probes   %14s   Hits %12s\n", "n/a", "n/a");
+    printf("TT Build with -DENABLE_TT_STATS for probe, hit, collision and replacement counters\n");
+#endif
+
+    printf("TT Hashfull %14d permill of %dMB\n", tt_hashfull(), tt_megabytes());
 }
 
 #ifdef ENABLE_MULTITHREAD
@@ -198,37 +841,49 @@ static void *tt_clear_threaded(void *cargo) {
     memset(Table.buckets + begin / sizeof(TTBucket), 0, end - begin);
     return NULL;
 }
+
+int tt_clear_workers(Thread *threads) {
+    // Only use 1/4th of the enabled search Threads
+    return MAX(1, threads->nthreads / 4);
+}
+
+void tt_clear_section(int index, int count) {
+
+    // Clear one of count sections of the Table, for a worker running on its own
+    struct TTClear ttclear = { index, count };
+    if (!Table.shmname[0]) tt_clear_threaded(&ttclear);
+}
 #endif
 
-void tt_clear(int nthreads) {
+void tt_clear(Thread *threads) {
+
+    // Other processes rely on the contents of a shared Table
+    if (Table.shmname[0]) return;
+
+    tt_restart();
 
 #ifdef ENABLE_MULTITHREAD
-    // Only use 1/4th of the enabled search Threads
-    int nworkers = MAX(1, nthreads / 4);
-    pthread_t pthreads[nworkers];
+    int nworkers = tt_clear_workers(threads);
 
     struct TTClear ttclears[nworkers];
 
-    // Initalize the data passed via a void* in pthread_create()
+    // Initalize the data passed via a void* to each worker
     for (int i = 0; i < nworkers; i++)
         ttclears[i] = (struct TTClear) { i, nworkers };
 
-    // Launch each of the helper threads to clear their sections
+    // Hand each of the pooled helper threads their sections
     for (int i = 1; i < nworkers; i++)
-        pthread_create(&pthreads[i], NULL, tt_clear_threaded, &ttclears[i]);
+        startThreadJob(&threads[i], tt_clear_threaded, &ttclears[i]);
 
     // Reuse this thread for the 0th sections of the Transposition Table
     tt_clear_threaded((void*) &ttclears[0]);
 
-    // Join each of the helper threads after they've cleared their sections
+    // Wait for each of the helper threads to clear their sections
     for (int i = 1; i < nworkers; i++)
-        pthread_join(pthreads[i], NULL);
+        waitThreadJob(&threads[i]);
 #else
-    (void)(nthreads);
-    int size = Table.hashMask + 1;
-    int bytes = (int)(size * sizeof(TTBucket));
-
-    memset(Table.buckets, 0, bytes);
+    (void)(threads);
+    memset(Table.buckets, 0, (Table.hashMask + 1) * sizeof(TTBucket));
 #endif
 }
 
@@ -37,18 +37,35 @@
 /// additional Zobrist bits. An Entry may also contain a static evaluation for
 /// the node, a search evaluation for the node, and a best move at that node.
 ///
-/// Each Entry contains 10-bytes of information. We group together entries into
-/// Buckets, containing three Entries a piece, as well as 2 additional bytes to
-/// pad out the structure to 32-bytes. This gives us multiple options when we
-/// run into a Zobrist collision with the Transposition Table lookup key.
+/// Each Entry packs 8-bytes of information into a single 64-bit data word, which
+/// is paired with a 16-bit key. The key stores the upper Zobrist bits XORed with
+/// a fold of the data word, so that a key and data pair which were written by two
+/// different threads will (almost always) fail to verify, in the style of Hyatt
+/// and Mann. Both words are read and written atomically, without any locking.
+///
+/// We group together three Entries into a Bucket, storing the keys first and the
+/// data words second, with 2 additional bytes to pad out the structure to 32-bytes.
+/// This gives us multiple options when we run into a Zobrist collision with the
+/// Transposition Table lookup key. When built with ENABLE_TT_CLUSTER64, Buckets
+/// instead hold six Entries and 4 bytes of padding, filling an entire cache line,
+/// so that each probe costs exactly one line fill and no line is shared between
+/// two unrelated Buckets.
 ///
 /// Generally, we prefer to replace entries that came from previous searches,
 /// as well as those which come from a lower depth. However, sometimes we do
 /// not replace any such entry, if it would be too harmful to do so.
 ///
+/// The Table may be saved to disk, and later mapped back into memory without any
+/// copying. Such files begin with a page-sized header, which records the layout of
+/// the Buckets and the generation of the Table, so incompatible files are refused.
+/// The Table may also be backed directly by a file, via the HashFile option, or by
+/// a named shared memory segment, via the SharedHash option. The latter lets several
+/// processes search with a single Table, relying on the lockless Entry format.
+///
 /// The minimum size of the Transposition Table is 2MB. This is so that we
-/// can lookup the table with at least 16-bits, and so that we may align the
-/// Table on a 2MB memory boundary, when available via the Operating System.
+/// can lookup the table with at least 16-bits (15-bits for 64-byte Buckets),
+/// and so that we may align the Table on a 2MB memory boundary, when available
+/// via the Operating System.
 
 enum {
     BOUND_NONE  = 0,
@@ -58,37 +75,110 @@ enum {
 
     TT_MASK_BOUND = 0x03,
     TT_MASK_AGE   = 0xFC,
-    TT_BUCKET_NB  = 3,
+
+    TT_FILE_VERSION = 1,
+    TT_HEADER_SIZE  = 4096,
+
+#ifdef ENABLE_TT_CLUSTER64
+    TT_BUCKET_NB   = 6,
+    TT_PADDING_NB  = 2,
+    TT_KEYSIZE_MIN = 15,
+#else
+    TT_BUCKET_NB   = 3,
+    TT_PADDING_NB  = 1,
+    TT_KEYSIZE_MIN = 16,
+#endif
 };
 
 struct TTEntry {
+    uint16_t move;
+    int16_t value, eval;
     int8_t depth;
     uint8_t generation;
-    int16_t eval, value;
-    uint16_t move, hash16;
 };
 
 struct TTBucket {
-    TTEntry slots[TT_BUCKET_NB];
-    uint16_t padding;
+    uint16_t keys[TT_BUCKET_NB];
+    uint16_t padding[TT_PADDING_NB];
+    uint64_t data[TT_BUCKET_NB];
+};
+
+struct TTHeader {
+    char magic[8];
+    uint32_t version, bucketSize, bucketEntries;
+    uint8_t generation;
+    uint64_t buckets;
+    uint32_t attached;
+    int32_t creator;
+};
+
+/// When built with ENABLE_TT_STATS, each Thread counts the outcomes of its probes
+/// and stores, so that the size of the Table can be chosen from data. A shadow
+/// of the full Zobrist Hash of each slot lets us spot 16-bit key collisions.
+
+struct TTStats {
+    uint64_t probes, hits, collisions, cutoffs;
+    uint64_t stores, skipped, sameKey, empty, aged, shallower;
 };
 
+/// In the Deterministic search mode, a Thread's stores go to its own Overlay rather
+/// than to the Table. Probes look at the Overlay first, so a Thread still sees its
+/// own stores at once, but only sees those of the others once they are published,
+/// in Thread order, at the end of each epoch. See epochSync() in thread.c
+
+enum { TT_OVERLAY_SIZE = 8192 };
+
+struct TTOverlayEntry {
+    uint64_t hash;
+    TTEntry entry;
+};
+
+#ifdef ENABLE_TT_STATS
+    #define TT_STAT(thread, field) ((thread)->ttstats.field++)
+#else
+    #define TT_STAT(thread, field) ((void)(thread))
+#endif
+
 struct TTable {
     TTBucket *buckets;
     uint64_t hashMask;
     uint8_t generation;
+    bool interleave;      // Interleave heap Tables over NUMA nodes
+    TTHeader *header;     // Start of the mapping, when the Table is mmap'd
+    char path[1024];      // File backing the Table, if set by HashFile
+    char shmname[256];    // Shared memory backing the Table, if set by SharedHash
+    char segment[256];    // Shared memory the Table is attached to, unlinked by the last
+#ifdef ENABLE_TT_STATS
+    uint64_t *shadow;     // Full Zobrist Hash of each slot, for ENABLE_TT_STATS
+#endif
 };
 
 void tt_update();
+void tt_restart();
 void tt_prefetch(uint64_t hash);
+int tt_megabytes();
 
-int tt_init(int nthreads, int megabytes);
+int tt_init(Thread *threads, int megabytes);
+void tt_free();
 int tt_hashfull();
-bool tt_probe(uint64_t hash, int height, uint16_t *move, int *value, int *eval, int *depth, int *bound);
-void tt_store(uint64_t hash, int height, uint16_t move, int value, int eval, int depth, int bound);
+bool tt_probe(Thread *thread, uint64_t hash, uint16_t *move, int *value, int *eval, int *depth, int *bound);
+void tt_store(Thread *thread, uint64_t hash, uint16_t move, int value, int eval, int depth, int bound);
+void tt_publish(Thread *thread);
+void tt_print_stats(const TTStats *stats);
 
 struct TTClear { int index, count; };
-void tt_clear(int nthreads);
+struct TTRehash { TTBucket *buckets; uint64_t hashMask; const TTable *source; int index, count; };
+void tt_clear(Thread *threads);
+#ifdef ENABLE_MULTITHREAD
+int tt_clear_workers(Thread *threads);
+void tt_clear_section(int index, int count);
+#endif
+
+bool tt_save(const char *path);
+bool tt_load(const char *path);
+bool tt_set_file(Thread *threads, const char *path);
+bool tt_set_shared(Thread *threads, const char *name);
+void tt_set_interleave(Thread *threads, bool interleave);
 
 /// The Pawn King table contains saved evaluations, and additional Pawn information
 /// that is expensive to compute during evaluation. This includes the location of all
@@ -95,6 +95,9 @@ typedef struct NodeState NodeState;
 typedef struct Thread Thread;
 typedef struct TTEntry TTEntry;
 typedef struct TTBucket TTBucket;
+typedef struct TTHeader TTHeader;
+typedef struct TTStats TTStats;
+typedef struct TTOverlayEntry TTOverlayEntry;
 typedef struct PKEntry PKEntry;
 typedef struct TTable TTable;
 typedef struct Limits Limits;
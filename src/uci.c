@@ -17,9 +17,7 @@
 */
 
 #include <inttypes.h>
-#ifdef ENABLE_MULTITHREAD
-#include <pthread.h>
-#endif
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,7 +32,7 @@
 #include "move.h"
 #include "movegen.h"
 #include "network.h"
-// #include "nnue/nnue.h"
+#include "nnue/nnue.h"
 #include "pyrrhic/tbprobe.h"
 #include "search.h"
 #include "thread.h"
@@ -47,29 +45,26 @@
 int NORMALIZE_EVAL = 1;
 
 extern int MoveOverhead;          // Defined by time.c
+extern int CalibratedTime;        // Defined by time.c
+extern int Deterministic;         // Defined by search.c
 //extern unsigned TB_PROBE_DEPTH;   // Defined by syzygy.c
 #ifdef ENABLE_MULTITHREAD
-extern volatile int ABORT_SIGNAL; // Defined by search.c
-extern volatile int IS_PONDERING; // Defined by search.c
+extern atomic_int ABORT_SIGNAL;   // Defined by search.c
+extern atomic_int IS_PONDERING;   // Defined by search.c
 #endif
 extern PKNetwork PKNN;            // Defined by network.c
 
 const char *StartPosition = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
-#ifdef ENABLE_MULTITHREAD
-static void uciGo(UCIGoStruct *ucigo, pthread_t *pthread, Thread *threads, Board *board, int multiPV, char *str)
-#else
 static void uciGo(UCIGoStruct *ucigo, Thread *threads, Board *board, int multiPV, char *str,
                   int hard_time_limit_msecs)
-#endif
 {
 #ifndef ENABLE_MULTI_PV
     (void)(multiPV);
 #endif
 
     /// Parse the entire "go" command in order to fill out a Limits struct, found at ucigo->limits.
-    /// After we have processed all of this, we can execute a new search thread, held by *pthread,
-    /// and detach it.
+    /// After we have processed all of this, we can hand the search to the main Thread's worker.
 
     double start = get_real_time();
     double wtime = 0, btime = 0;
@@ -86,6 +81,7 @@ static void uciGo(UCIGoStruct *ucigo, Thread *threads, Board *board, int multiPV
     memset(limits, 0, sizeof(Limits));
 
 #ifdef ENABLE_MULTITHREAD
+    ABORT_SIGNAL = FALSE; // Reset here, so that a quick "stop" is never lost
     IS_PONDERING = FALSE; // Reset PONDERING every time to be safe
 #endif
 
@@ -143,30 +139,47 @@ static void uciGo(UCIGoStruct *ucigo, Thread *threads, Board *board, int multiPV
     limits->multiPV = MIN(multiPV, limits->limitedByMoves ? idx : size);
 #endif
 
-    // Prepare the uciGoStruct for the new pthread
+    // Prepare the uciGoStruct for the search
     ucigo->board   = board;
     ucigo->threads = threads;
 
 #ifdef REPORT_DIAGNOSTICS
     printf("Number of threads: %d\n", ucigo->threads->nthreads);
 #endif
-    // Spawn a new thread to handle the search
+    // Wake the main Thread's worker to handle the search
 #ifdef ENABLE_MULTITHREAD
-    pthread_create(pthread, NULL, &start_search_threads, ucigo);
-    pthread_detach(*pthread);
+    startThreadJob(threads, &start_search_threads, ucigo);
 #else
     start_search_threads(ucigo);
 #endif
 }
 
+void uciGoPosition(UCIGoStruct *ucigo, Thread *threads, Board *board, int multiPV, char *str, int chess960) {
+
+    /// Custom "gp <go arguments> fen <FEN>" command, which sets the position and
+    /// starts a search in a single request. Positions with fewer than 8 pieces are
+    /// always searched with a fixed 100ms limit, in place of any given movetime
+
+    int hard_time_limit = 0;
+    int empty_squares = 0;
+
+    boardFromFEN(board, strstr(str, "fen") + strlen("fen "), chess960);
+    strstr(str, "fen")[-1] = 0;
+
+    for (int i = 0; i < 64; i++)
+        empty_squares += (int)(board->squares[i] == EMPTY);
+    int pieces_on_board = 64 - empty_squares;
+    if (pieces_on_board < 8) {
+        hard_time_limit = 100;
+    }
+    uciGo(ucigo, threads, board, multiPV, str, hard_time_limit);
+}
+
 int main(int argc, char **argv) {
 
     Board board;
     char str[8192] = {0};
     Thread *threads;
-#ifdef ENABLE_MULTITHREAD
-    pthread_t pthreadsgo;
-#endif
     UCIGoStruct uciGoStruct;
 
     int chess960 = 0;
@@ -182,15 +195,15 @@ int main(int argc, char **argv) {
     InitHashTables();
 #endif
 #endif
-    tt_init(1, 1);
 
     initPKNetwork();
     tb_init("");
-    //nnue_incbin_init();
+    nnue_incbin_init();
 
-    // Create the UCI-board and our threads
+    // Create the UCI-board, our threads, and the TTable
     threads = createThreadPool(1);
     boardFromFEN(&board, StartPosition, chess960);
+    tt_init(threads, 16);
 
     // Handle any command line requests
     handleCommandLine(argc, argv);
@@ -200,7 +213,7 @@ int main(int argc, char **argv) {
     |  Commands  | Response. * denotes that the command blocks until no longer searching |
     |------------|-----------------------------------------------------------------------|
     |        uci |           Outputs the engine name, authors, and all available options |
-    |    isready | *           Responds with readyok when no longer searching a position |
+    |    isready |         Responds with readyok at once, even while searching a position |
     | ucinewgame | *  Resets the TT and any Hueristics to ensure determinism in searches |
     |  setoption | *     Sets a given option and reports that the option was set if done |
     |   position | *  Sets the board position via an optional FEN and optional move list |
@@ -208,35 +221,42 @@ int main(int argc, char **argv) {
     |  ponderhit |          Flags the search to indicate that the ponder move was played |
     |       stop |            Signals the search threads to finish and report a bestmove |
     |       quit |             Exits the engine and any searches by killing the UCI loop |
-    |      perft |            Custom command to compute PERFT(N) of the current position |
-    |      print |         Custom command to print an ASCII view of the current position |
+    |      perft | *          Custom command to compute PERFT(N) of the current position |
+    |      print | *       Custom command to print an ASCII view of the current position |
+    |   savehash | *          Custom command to write the Transposition Table to a file |
+    |   loadhash | *    Custom command to map a Transposition Table back from a file |
+    |  hashstats | *    Custom command to print TT statistics from the most recent search |
     |------------|-----------------------------------------------------------------------|
     */
 
     while (getInput(str)) {
 
-        if (strStartsWith(str, "gp")) {
-            boardFromFEN(&board, strstr(str, "fen") + strlen("fen "), chess960);
-            strstr(str, "fen")[-1] = 0;
-
-            int hard_time_limit = 0;
-            int empty_squares = 0;
-            for (int i = 0; i < 64; i++)
-                empty_squares += (int)(board.squares[i] == EMPTY);
-            int pieces_on_board = 64 - empty_squares;
-            if (pieces_on_board < 8) {
-                hard_time_limit = 100;
-            }
-            uciGo(&uciGoStruct, threads, &board, multiPV, str, hard_time_limit);
-        }
+#ifdef ENABLE_MULTITHREAD
+        // Never modify the Board, Limits, Table or Threads of a running search
+        if (uciBlocksOnSearch(str))
+            waitThreadJob(threads);
+
+        // Never touch the Table from here while the workers are clearing it
+        if (uciBlocksOnWorkers(str))
+            waitThreadPool(threads);
+#endif
+
+        if (strStartsWith(str, "gp"))
+            uciGoPosition(&uciGoStruct, threads, &board, multiPV, str, chess960);
+
         else if (strEquals(str, "uci")) {
             printf("id name Ethereal " ETHEREAL_VERSION "\n");
             printf("id author Andrew Grant, Alayan & Laldon\n");
             printf("option name Hash type spin default 16 min 2 max 131072\n");
+            printf("option name HashFile type string default <empty>\n");
+            printf("option name SharedHash type string default <empty>\n");
+            printf("option name HashInterleave type check default false\n");
             printf("option name Threads type spin default 1 min 1 max 2048\n");
+            printf("option name Deterministic type check default false\n");
             printf("option name EvalFile type string default <empty>\n");
             printf("option name MultiPV type spin default 1 min 1 max 256\n");
             printf("option name MoveOverhead type spin default 300 min 0 max 10000\n");
+            printf("option name CalibratedTime type check default false\n");
             printf("option name SyzygyPath type string default <empty>\n");
             printf("option name SyzygyProbeDepth type spin default 0 min 0 max 127\n");
             printf("option name Ponder type check default false\n");
@@ -249,7 +269,7 @@ int main(int argc, char **argv) {
             printf("readyok\n"), fflush(stdout);
 
         else if (strEquals(str, "ucinewgame"))
-            resetThreadPool(threads), tt_clear(threads->nthreads);
+            newGameThreadPool(threads);
 
         else if (strStartsWith(str, "setoption"))
             uciSetOption(str, &threads, &multiPV, &chess960);
@@ -258,18 +278,16 @@ int main(int argc, char **argv) {
             uciPosition(str, &board, chess960);
 
         else if (strStartsWith(str, "go"))
-#ifdef ENABLE_MULTITHREAD
-            uciGo(&uciGoStruct, &pthreadsgo, threads, &board, multiPV, str);
-#else
             uciGo(&uciGoStruct, threads, &board, multiPV, str, 0);
-#endif
 
 #ifdef ENABLE_MULTITHREAD
         else if (strEquals(str, "ponderhit"))
             IS_PONDERING = 0;
 
-        else if (strEquals(str, "stop"))
-            ABORT_SIGNAL = 1, IS_PONDERING = 0;
+        else if (strEquals(str, "stop")) {
+            ABORT_SIGNAL = 1;
+            IS_PONDERING = 0;
+        }
 #endif
 
         else if (strEquals(str, "quit"))
@@ -281,19 +299,71 @@ int main(int argc, char **argv) {
 #endif
         else if (strStartsWith(str, "print"))
             printBoard(&board), fflush(stdout);
+
+        else if (strStartsWith(str, "savehash"))
+            uciSaveHash(str);
+
+        else if (strStartsWith(str, "loadhash"))
+            uciLoadHash(str);
+
+        else if (strEquals(str, "hashstats"))
+            uciHashStats(threads);
     }
 
+#ifdef ENABLE_MULTITHREAD
+    // Finish any search before retiring the Threads
+    ABORT_SIGNAL = TRUE;
+    IS_PONDERING = FALSE;
+#endif
+    deleteThreadPool(threads);
+    tt_free();
+
     return 0;
 }
 
+int uciBlocksOnSearch(char *str) {
+
+    // Commands marked with a * in the table found in main()
+    static char *Blocking[] = {
+        "gp", "ucinewgame", "setoption", "position", "go",
+        "perft", "print", "savehash", "loadhash", "hashstats", NULL
+    };
+
+    for (int i = 0; Blocking[i] != NULL; i++)
+        if (strStartsWith(str, Blocking[i])) return TRUE;
+
+    return FALSE;
+}
+
+int uciBlocksOnWorkers(char *str) {
+
+    // Commands which use the Table without handing the work to the
+    // workers, and so must wait for a ucinewgame to finish clearing
+    static char *Blocking[] = { "setoption", "savehash", "loadhash", "hashstats", NULL };
+
+    for (int i = 0; Blocking[i] != NULL; i++)
+        if (strStartsWith(str, Blocking[i])) return TRUE;
+
+    return FALSE;
+}
+
 void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960) {
 
     // Handle setting UCI options in Ethereal. Options include:
     //  Hash                : Size of the Transposition Table in Megabyes
+    //  HashFile            : File to back the Transposition Table, kept across runs
+    //  SharedHash          : Shared memory to back the Transposition Table, across processes.
+    //                        Removed when the last process quits. After a crash, rm /dev/shm/<name>
+    //  HashInterleave      : Interleave the Transposition Table across NUMA nodes
     //  Threads             : Number of search threads to use
+    //  Deterministic       : Reproducible multi-threaded searches, given node or depth limits.
+    //                        Limits are checked every 8192 nodes per Thread, so node limits
+    //                        overshoot by up to Threads * 8192 nodes. Time limits are kept,
+    //                        but timed searches are not reproducible
     //  EvalFile            : Network weights for Ethereal's NNUE evaluation
     //  MultiPV             : Number of search lines to report per iteration
     //  MoveOverhead        : Overhead on time allocation to avoid time losses
+    //  CalibratedTime      : Turn a movetime into a node budget, from recently measured nps
     //  SyzygyPath          : Path to Syzygy Tablebases
     //  SyzygyProbeDepth    : Minimal Depth to probe the highest cardinality Tablebase
     //  Normalize           : Normalize UCI output to hope that +1.00 is 50% Won, 50% Drawn
@@ -301,7 +371,30 @@ void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960) {
 
     if (strStartsWith(str, "setoption name Hash value ")) {
         int megabytes = atoi(str + strlen("setoption name Hash value "));
-        printf("info string set Hash to %dMB\n", tt_init((*threads)->nthreads, megabytes));
+        double start = get_real_time();
+        printf("info string set Hash to %dMB\n", tt_init(*threads, megabytes));
+        printf("info string rehashed Hash in %.1f ms\n", get_real_time() - start);
+    }
+
+    if (strStartsWith(str, "setoption name HashFile value ")) {
+        char *ptr = str + strlen("setoption name HashFile value ");
+        if (strStartsWith(ptr, "<empty>")) ptr[0] = '\0';
+        if (tt_set_file(*threads, ptr)) printf("info string set HashFile to %s\n", ptr[0] ? ptr : "<empty>");
+        else printf("info string unable to use %s for HashFile\n", ptr);
+    }
+
+    if (strStartsWith(str, "setoption name SharedHash value ")) {
+        char *ptr = str + strlen("setoption name SharedHash value ");
+        if (strStartsWith(ptr, "<empty>")) ptr[0] = '\0';
+        if (tt_set_shared(*threads, ptr)) printf("info string set SharedHash to %s (%dMB)\n", ptr[0] ? ptr : "<empty>", tt_megabytes());
+        else printf("info string unable to use %s for SharedHash\n", ptr);
+    }
+
+    if (strStartsWith(str, "setoption name HashInterleave value ")) {
+        if (strStartsWith(str, "setoption name HashInterleave value true"))
+            printf("info string set HashInterleave to true\n"), tt_set_interleave(*threads, TRUE);
+        if (strStartsWith(str, "setoption name HashInterleave value false"))
+            printf("info string set HashInterleave to false\n"), tt_set_interleave(*threads, FALSE);
     }
 
     if (strStartsWith(str, "setoption name Threads value ")) {
@@ -310,11 +403,19 @@ void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960) {
         printf("info string set Threads to %d\n", nthreads);
     }
 
-    // if (strStartsWith(str, "setoption name EvalFile value ")) {
-    //     char *ptr = str + strlen("setoption name EvalFile value ");
-    //     if (!strStartsWith(ptr, "<empty>")) nnue_init(ptr);
-    //     printf("info string set EvalFile to %s\n", ptr);
-    // }
+    if (strStartsWith(str, "setoption name Deterministic value ")) {
+        if (strStartsWith(str, "setoption name Deterministic value true"))
+            printf("info string set Deterministic to true\n"), Deterministic = 1;
+        if (strStartsWith(str, "setoption name Deterministic value false"))
+            printf("info string set Deterministic to false\n"), Deterministic = 0;
+    }
+
+    if (strStartsWith(str, "setoption name EvalFile value ")) {
+        char *ptr = str + strlen("setoption name EvalFile value ");
+        nnue_init(strStartsWith(ptr, "<empty>") ? NULL : ptr);
+        newNetworkThreadPool(*threads);
+        printf("info string set EvalFile to %s\n", ptr);
+    }
 
     if (strStartsWith(str, "setoption name MultiPV value ")) {
         *multiPV = atoi(str + strlen("setoption name MultiPV value "));
@@ -326,6 +427,13 @@ void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960) {
         printf("info string set MoveOverhead to %d\n", MoveOverhead);
     }
 
+    if (strStartsWith(str, "setoption name CalibratedTime value ")) {
+        if (strStartsWith(str, "setoption name CalibratedTime value true"))
+            printf("info string set CalibratedTime to true\n"), CalibratedTime = 1;
+        if (strStartsWith(str, "setoption name CalibratedTime value false"))
+            printf("info string set CalibratedTime to false\n"), CalibratedTime = 0;
+    }
+
 #if 0
     if (strStartsWith(str, "setoption name SyzygyPath value ")) {
         char *ptr = str + strlen("setoption name SyzygyPath value ");
@@ -356,6 +464,30 @@ void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960) {
     fflush(stdout);
 }
 
+void uciSaveHash(char *str) {
+
+    char *path = str + MIN(strlen(str), strlen("savehash "));
+
+    if (tt_save(path)) printf("info string saved hash to %s\n", path);
+    else printf("info string unable to save hash to %s\n", path);
+    fflush(stdout);
+}
+
+void uciLoadHash(char *str) {
+
+    char *path = str + MIN(strlen(str), strlen("loadhash "));
+
+    if (!tt_load(path)) printf("info string unable to load hash from %s\n", path);
+    else printf("info string loaded %dMB of hash from %s\n", tt_megabytes(), path);
+    fflush(stdout);
+}
+
+void uciHashStats(Thread *threads) {
+    TTStats stats = {0};
+    ttstatsThreadPool(threads, &stats);
+    tt_print_stats(&stats), fflush(stdout);
+}
+
 void uciPosition(char *str, Board *board, int chess960) {
 
     int size;
@@ -18,9 +18,6 @@
 
 #pragma once
 
-#ifdef ENABLE_MULTITHREAD
-#include <pthread.h>
-#endif
 #include <stdint.h>
 
 #include "types.h"
@@ -47,12 +44,18 @@ struct UCIGoStruct {
     Limits  limits;
 };
 
+void uciGoPosition(UCIGoStruct *ucigo, Thread *threads, Board *board, int multiPV, char *str, int chess960);
 void uciSetOption(char *str, Thread **threads, int *multiPV, int *chess960);
 void uciPosition(char *str, Board *board, int chess960);
+void uciSaveHash(char *str);
+void uciLoadHash(char *str);
+void uciHashStats(Thread *threads);
 
 void uciReport(Thread *threads, PVariation *pv, int alpha, int beta);
 void uciReportCurrentMove(Board *board, uint16_t move, int currmove, int depth);
 
+int uciBlocksOnSearch(char *str);
+int uciBlocksOnWorkers(char *str);
 int strEquals(char *str1, char *str2);
 int strStartsWith(char *str, char *key);
 int strContains(char *str, char *key);
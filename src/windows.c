@@ -21,12 +21,128 @@
 #pragma GCC diagnostic ignored "-Wcast-function-type"
 #endif
 
-//#include "windows.h"
+// Needed for sched_setaffinity() and the CPU_SET() macros
+#if defined(__linux__) && !defined(__ANDROID__)
+    #define _GNU_SOURCE
+    #include <sched.h>
+    #include <stdbool.h>
+    #include <stdio.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+#include "windows.h"
+
+#if defined(__linux__) && !defined(__ANDROID__)
+
+static bool readCpuList(const char *path, cpu_set_t *set) {
+
+    // Parse a sysfs list such as "0-15,32-47" into a cpu_set_t. The same
+    // format is used for lists of CPUs and for lists of NUMA nodes
+
+    int first, last, read;
+    char buffer[4096], *ptr = buffer;
+    FILE *fin = fopen(path, "r");
+
+    CPU_ZERO(set);
+
+    if (fin == NULL)
+        return FALSE;
+
+    bool okay = fgets(buffer, sizeof(buffer), fin) != NULL;
+    fclose(fin);
+
+    if (!okay) return FALSE;
+
+    while (sscanf(ptr, "%d%n", &first, &read) == 1) {
+
+        last = first, ptr += read;
+
+        if (*ptr == '-' && sscanf(ptr + 1, "%d%n", &last, &read) == 1)
+            ptr += read + 1;
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+
+        if (*ptr++ != ',') break;
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+static int bestNode(int index, cpu_set_t *cpus) {
+
+    // bestNode() mirrors bestGroup() for Windows, without needing libnuma. Run as many
+    // threads as possible on the same node until its CPUs are used, then move on filling
+    // the next node. Returns -1, to let the OS decide, when there is nothing to gain
+
+    char path[64];
+    cpu_set_t nodes;
+    int seen = 0;
+
+    if (   !readCpuList("/sys/devices/system/node/online", &nodes)
+        ||  CPU_COUNT(&nodes) <= 1)
+        return -1;
+
+    for (int node = 0; node < CPU_SETSIZE; node++) {
+
+        if (!CPU_ISSET(node, &nodes))
+            continue;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (readCpuList(path, cpus) && index < (seen += CPU_COUNT(cpus)))
+            return node;
+    }
 
-#ifndef _WIN32
+    return -1;
+}
+
+void bindThisThread(int index) {
+
+    // bindThisThread() restricts the current thread to the CPUs of its node
+
+    cpu_set_t cpus;
+
+    if (bestNode(index, &cpus) != -1)
+        sched_setaffinity(0, sizeof(cpu_set_t), &cpus);
+}
+
+int numaNodeCount() {
+
+    cpu_set_t nodes;
+
+    return readCpuList("/sys/devices/system/node/online", &nodes)
+         ? CPU_COUNT(&nodes) : 1;
+}
+
+void interleaveMemory(void *memory, size_t size) {
+
+    // Spread the pages of a large allocation over every NUMA node in a round
+    // robin fashion, via mbind(MPOL_INTERLEAVE). This must happen before the
+    // memory is first touched. Nodes beyond the 64th are simply not used
+
+    const int MPOL_INTERLEAVE = 3;
+
+    cpu_set_t nodes;
+    unsigned long mask = 0;
+
+    if (!readCpuList("/sys/devices/system/node/online", &nodes) || CPU_COUNT(&nodes) <= 1)
+        return;
+
+    for (int node = 0; node < 64; node++)
+        if (CPU_ISSET(node, &nodes)) mask |= 1ul << node;
+
+    syscall(SYS_mbind, memory, size, MPOL_INTERLEAVE, &mask, 65, 0);
+}
+
+#elif !defined(_WIN32)
 
 void bindThisThread(int index) { (void)index; };
 
+int numaNodeCount() { return 1; }
+
+void interleaveMemory(void *memory, size_t size) { (void)memory, (void)size; }
+
 #else
 
 static int bestGroup(int index) {
@@ -110,4 +226,13 @@ void bindThisThread(int index) {
         fun3(GetCurrentThread(), &affinity, NULL);
 }
 
+int numaNodeCount() {
+
+    ULONG highest;
+
+    return GetNumaHighestNodeNumber(&highest) ? (int) highest + 1 : 1;
+}
+
+void interleaveMemory(void *memory, size_t size) { (void)memory, (void)size; }
+
 #endif
\ No newline at end of file
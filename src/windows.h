@@ -18,6 +18,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #include "types.h"
 
 #ifdef _WIN32
@@ -40,3 +42,5 @@ typedef int (*fun3_t) (HANDLE, CONST GROUP_AFFINITY*, PGROUP_AFFINITY);
 #endif
 
 void bindThisThread(int index);
+int numaNodeCount();
+void interleaveMemory(void *memory, size_t size);